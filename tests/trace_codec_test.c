@@ -0,0 +1,134 @@
+/*
+ * Round trip and corruption test of the block codec of compressed trace files and
+ * streams (see COMPRESSED TRACE FILES in tomasulo.c). It includes tomasulo.c to reach its
+ * static functions, so it is built from the simulator directory with the objects
+ * tomasulo.c needs, e.g.
+ * 	gcc -I. -o trace_codec_test tests/trace_codec_test.c misc.o machine.o options.o -lpthread -lm
+ * and prints the number of blocks checked, or exits with an error on the first mismatch.
+ */
+#include "../tomasulo.c"
+
+//what a simulator main provides to tomasulo.c
+counter_t sim_num_insn = 0;
+
+instruction_t* get_instr(instruction_trace_t* trace, int index) {
+  while (index >= INSTR_TRACE_SIZE) {
+    trace = trace->next;
+    index -= INSTR_TRACE_SIZE;
+  }
+  return &trace->table[index];
+}
+
+static qword_t seed = 1;
+
+static qword_t next_random(void) {
+  seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+  return seed >> 16;
+}
+
+//a register, or no register at all
+static unsigned char random_reg(void) {
+  return next_random() % 8 == 0 ? NO_REG : (unsigned char)(next_random() % MD_TOTAL_REGS);
+}
+
+/* 
+ * Description: 
+ * 	Fills an encoder with random instructions: few distinct tuples, producer
+ *      distances of every size and PCs that mostly step forward but also jump both ways
+ * Inputs:
+ * 	enc: the encoder
+ * 	n: number of instructions
+ * Returns:
+ * 	None
+ */
+static void random_block(tom_block_encoder_t* enc, int n) {
+  md_addr_t pc = (md_addr_t)(next_random() & ~(qword_t)7);
+
+  memset(enc->recs, 0, n * sizeof(tom_record_t));
+  for (int i = 0; i < n; i++) {
+    tom_record_t* rec = &enc->recs[i];
+    rec->op_class = (unsigned char)(next_random() % OPC_UNKNOWN);
+    for (int j = 0; j < 3; j++) {
+      rec->r_in[j] = random_reg();
+    }
+    rec->r_out[0] = random_reg();
+    rec->r_out[1] = random_reg();
+    for (int j = 0; j < 3; j++) {
+      const int kind = next_random() % 4;
+      rec->producer_dist[j] = kind == 0 ? 0 : kind == 1 ? UINT_MAX : (unsigned int)(next_random() % (i + 2));
+    }
+    pc = next_random() % 16 == 0 ? (md_addr_t)next_random() : pc + sizeof(md_inst_t);
+    enc->pc[i] = pc;
+  }
+}
+
+static bool same_records(const tom_record_t* a, const tom_record_t* b) {
+  return a->op_class == b->op_class && memcmp(a->r_in, b->r_in, sizeof(a->r_in)) == 0
+         && memcmp(a->r_out, b->r_out, sizeof(a->r_out)) == 0
+         && memcmp(a->producer_dist, b->producer_dist, sizeof(a->producer_dist)) == 0;
+}
+
+int main(void) {
+  const int sizes[] = { 1, 2, 7, 64, 1000, TRACE_BLOCK_INSNS };
+  const int nsizes = sizeof(sizes) / sizeof(sizes[0]);
+  int checked = 0;
+
+  for (int s = 0; s < nsizes; s++) {
+    const int block_insns = sizes[s];
+    tom_block_encoder_t enc;
+    tom_record_t* recs = calloc(block_insns, sizeof(tom_record_t));
+    md_addr_t* pc = calloc(block_insns, sizeof(md_addr_t));
+    qword_t* dict = calloc(block_insns, sizeof(qword_t));
+    unsigned char* copy = malloc(BLOCK_BOUND(block_insns) + 1);
+
+    if (!recs || !pc || !dict || !copy)
+      fatal("out of virtual memory");
+    block_encoder_init(&enc, block_insns);
+
+    for (int round = 0; round < 20; round++) {
+      //full blocks, and the shorter last block of a trace
+      const int n = round % 2 ? block_insns : 1 + (int)(next_random() % block_insns);
+      random_block(&enc, n);
+      const size_t size = encode_block(&enc, n);
+      if (size > BLOCK_BOUND(n))
+        fatal("block of %d instructions takes %lu bytes", n, (unsigned long)size);
+
+      if (!decode_block(enc.out, size, n, recs, pc, dict))
+        fatal("block of %d instructions does not decode", n);
+      for (int i = 0; i < n; i++) {
+        if (!same_records(&recs[i], &enc.recs[i]) || pc[i] != enc.pc[i])
+          fatal("instruction %d of a block of %d does not round trip", i, n);
+      }
+
+      //a block cut short or followed by anything else is corrupt
+      for (size_t cut = 0; cut < size; cut += 1 + size / 64) {
+        if (decode_block(enc.out, cut, n, recs, pc, dict))
+          fatal("block of %d instructions cut to %lu bytes decodes", n, (unsigned long)cut);
+      }
+      memcpy(copy, enc.out, size);
+      copy[size] = 0;
+      if (decode_block(copy, size + 1, n, recs, pc, dict))
+        fatal("block of %d instructions with a trailing byte decodes", n);
+      //and a block read as one instruction shorter than it is
+      if (n > 1 && decode_block(enc.out, size, n - 1, recs, pc, dict))
+        fatal("block of %d instructions decodes as %d", n, n - 1);
+
+      //damaged blocks may decode to other instructions, but must stay within their bytes
+      for (int flip = 0; flip < 16; flip++) {
+        memcpy(copy, enc.out, size);
+        copy[next_random() % size] ^= (unsigned char)(1 << (next_random() % 8));
+        decode_block(copy, size, n, recs, pc, dict);
+      }
+      checked++;
+    }
+
+    block_encoder_free(&enc);
+    free(recs);
+    free(pc);
+    free(dict);
+    free(copy);
+  }
+
+  printf("%d blocks round trip\n", checked);
+  return 0;
+}
@@ -5,6 +5,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <sched.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TOM_X86_SIMD
+#include <immintrin.h>
+#endif
 
 #include "host.h"
 #include "misc.h"
@@ -20,9 +34,12 @@
 #include "decode.def"
 
 #include "instr.h"
+#include "tomasulo.h"
 
 /* PARAMETERS OF THE TOMASULO'S ALGORITHM */
 
+//defaults of the -tom: options
+
 #define INSTR_QUEUE_SIZE         10
 
 #define RESERV_INT_SIZE    4
@@ -33,6 +50,32 @@
 #define FU_INT_LATENCY     4
 #define FU_FP_LATENCY      9
 
+#define CDB_WIDTH          1
+
+#define FETCH_WIDTH        1
+#define DISPATCH_WIDTH     1
+
+//jump over cycles in which no stage can make progress (1) or step through every cycle (0)
+#define SKIP_IDLE_CYCLES   1
+
+//instructions per compressed block of a trace file
+#define TRACE_BLOCK_INSNS  16384
+
+//threads decompressing the blocks of a replayed trace, and how many blocks they stay ahead
+#define BLOCK_THREADS      2
+#define READ_AHEAD_BLOCKS  8
+
+//Configurations that get their own engine with the sizes compiled in. runTomasulo uses
+//the matching one, or the generic engine when the options match none of them.
+//         name      ifq  rs_int  rs_fp  fu_int  fu_fp  lat_int  lat_fp  cdb  fetch  dispatch
+#define TOM_ENGINE_PRESETS \
+  TOM_ENGINE(default,  INSTR_QUEUE_SIZE, RESERV_INT_SIZE, RESERV_FP_SIZE, \
+                       FU_INT_SIZE, FU_FP_SIZE, FU_INT_LATENCY, FU_FP_LATENCY, CDB_WIDTH, \
+                       FETCH_WIDTH, DISPATCH_WIDTH) \
+  TOM_ENGINE(wide,     16,    8,      4,      4,      2,     4,       9,    1,   1,     1) \
+  TOM_ENGINE(rs16,     32,   16,      8,      4,      2,     4,       9,    1,   1,     1) \
+  TOM_ENGINE(rs64,     64,   64,     32,      8,      4,     4,       9,    1,   1,     1)
+
 /* IDENTIFYING INSTRUCTIONS */
 
 //unconditional branch, jump or call
@@ -75,385 +118,3497 @@
   md_print_insn(instr->inst, instr->pc, out); \
   myfprintf(stdout, "(%d)\n",instr->index);
 
-/* VARIABLES */
+/* MACHINE CONFIGURATION */
 
-static int doneCount = 0;
+//the configuration selected with the -tom: options
+static tom_config_t tom_config = {
+  INSTR_QUEUE_SIZE, RESERV_INT_SIZE, RESERV_FP_SIZE, FU_INT_SIZE, FU_FP_SIZE, FU_INT_LATENCY, FU_FP_LATENCY,
+  CDB_WIDTH, FETCH_WIDTH, DISPATCH_WIDTH
+};
 
-//instruction queue for tomasulo
-static instruction_t* instr_queue[INSTR_QUEUE_SIZE];
-//number of instructions in the instruction queue
-static int instr_queue_size = 0;
-static int ifq_head = 0;
-static int ifq_tail = 0;
+static int skip_idle_cycles = SKIP_IDLE_CYCLES;
 
-//reservation stations (each reservation station entry contains a pointer to an instruction)
-static instruction_t* reservINT[RESERV_INT_SIZE];
-static instruction_t* reservFP[RESERV_FP_SIZE];
+//always use the generic engine
+static int force_generic_engine = FALSE;
 
-//functional units
-static instruction_t* fuINT[FU_INT_SIZE];
-static instruction_t* fuFP[FU_FP_SIZE];
+//number of runs of each engine timed by the engine benchmark (0 disables it)
+static int engine_bench_runs = 0;
 
-//common data bus
-static instruction_t* commonDataBus = NULL;
+//use the scalar wakeup kernel even if the CPU has vector instructions
+static int force_scalar_wakeup = FALSE;
 
-//The map table keeps track of which instruction produces the value for each register
-static instruction_t* map_table[MD_TOTAL_REGS];
+//file listing the configurations of a parameter sweep (NULL disables the sweep)
+static char* sweep_file = NULL;
+//file the sweep results are written to (NULL for stderr)
+static char* sweep_out_file = NULL;
+//number of threads running the sweep (0 for one per online processor)
+static int sweep_threads = 0;
 
-//the index of the last instruction fetched
-static int fetch_index = 0;
+//decode the trace on its own thread, feeding the timing model through a ring
+static int decode_thread = TRUE;
 
-/* FUNCTIONAL UNITS */
+//file the decoded trace is written to (NULL to not write it)
+static char* trace_out_file = NULL;
+//trace file simulated instead of the trace of the functional simulator (NULL to not replay)
+static char* replay_file = NULL;
+//instructions per compressed block of a written trace file (0 for an uncompressed file)
+static int trace_block_insns = TRACE_BLOCK_INSNS;
+//threads decompressing a replayed compressed trace (0 to decompress on the simulator thread)
+static int block_threads = BLOCK_THREADS;
+//blocks they decompress ahead of the simulator
+static int read_ahead_blocks = READ_AHEAD_BLOCKS;
+//directory of the trace cache (NULL disables it)
+static char* trace_cache_dir = NULL;
+//trace stream the decoded trace is sent to (NULL to not send it)
+static char* stream_out_name = NULL;
+//trace stream simulated instead of the trace of the functional simulator (NULL for none)
+static char* stream_in_name = NULL;
 
+//reservation stations are numbered INT first, then FP
+#define RESERV_TOTAL(cfg)  ((cfg).rs_int_size + (cfg).rs_fp_size)
 
-/* RESERVATION STATIONS */
+//In-flight instructions are named by small tags. A tag is held from dispatch until the
+//result has been broadcast; the reservation station is released one cycle earlier, so a
+//machine needs one tag per station plus one for each instruction on a bus.
+typedef unsigned short tom_tag_t;
+#define NO_TAG             0xffff
+#define FETCHED_TAG        0xfffe
+#define TAG_COUNT(cfg)     (RESERV_TOTAL(cfg) + (cfg).cdb_width)
 
+//number of cycles tracked by the completion wheel (one more than the longest latency)
+#define WHEEL_SIZE(cfg)    (((cfg).fu_int_latency > (cfg).fu_fp_latency ? \
+                             (cfg).fu_int_latency : (cfg).fu_fp_latency) + 1)
+
+//The pipeline functions take the configuration by value and are always inlined into the
+//simulation loop. Each copy of the loop therefore sees either the runtime configuration or
+//compile-time constants, and the constant copies get fully unrolled fixed-size loops.
+#ifdef __GNUC__
+#define TOM_INLINE static inline __attribute__((always_inline))
+#else
+#define TOM_INLINE static inline
+#endif
 
 /* 
  * Description: 
- * 	Checks if simulation is done by finishing the very last instruction
- *      Remember that simulation is done only if the entire pipeline is empty
+ * 	Registers the parameters of the Tomasulo model with the options database
  * Inputs:
- * 	sim_insn: the total number of instructions simulated
+ * 	odb: the options database
  * Returns:
- * 	True: if simulation is finished
+ * 	None
  */
-static bool is_simulation_done(counter_t sim_insn) {
+void tomasulo_reg_options(struct opt_odb_t *odb) {
+  opt_reg_int(odb, "-tom:ifqsize", "instruction queue size (in insts)",
+              &tom_config.ifq_size, INSTR_QUEUE_SIZE, TRUE, NULL);
+  opt_reg_int(odb, "-tom:rs_int", "number of integer reservation stations",
+              &tom_config.rs_int_size, RESERV_INT_SIZE, TRUE, NULL);
+  opt_reg_int(odb, "-tom:rs_fp", "number of floating-point reservation stations",
+              &tom_config.rs_fp_size, RESERV_FP_SIZE, TRUE, NULL);
+  opt_reg_int(odb, "-tom:fu_int", "number of integer functional units",
+              &tom_config.fu_int_size, FU_INT_SIZE, TRUE, NULL);
+  opt_reg_int(odb, "-tom:fu_fp", "number of floating-point functional units",
+              &tom_config.fu_fp_size, FU_FP_SIZE, TRUE, NULL);
+  opt_reg_int(odb, "-tom:lat_int", "integer functional unit latency (in cycles)",
+              &tom_config.fu_int_latency, FU_INT_LATENCY, TRUE, NULL);
+  opt_reg_int(odb, "-tom:lat_fp", "floating-point functional unit latency (in cycles)",
+              &tom_config.fu_fp_latency, FU_FP_LATENCY, TRUE, NULL);
+  opt_reg_int(odb, "-tom:cdb", "number of common data buses (results broadcast per cycle)",
+              &tom_config.cdb_width, CDB_WIDTH, TRUE, NULL);
+  opt_reg_int(odb, "-tom:fetch_width", "instructions fetched per cycle",
+              &tom_config.fetch_width, FETCH_WIDTH, TRUE, NULL);
+  opt_reg_int(odb, "-tom:dispatch_width", "instructions dispatched per cycle",
+              &tom_config.dispatch_width, DISPATCH_WIDTH, TRUE, NULL);
+  opt_reg_flag(odb, "-tom:skip_idle", "jump over cycles in which nothing can change",
+               &skip_idle_cycles, SKIP_IDLE_CYCLES, TRUE, NULL);
+  opt_reg_flag(odb, "-tom:generic", "always use the generic engine",
+               &force_generic_engine, FALSE, TRUE, NULL);
+  opt_reg_flag(odb, "-tom:scalar_wakeup", "do not use vector instructions for the CDB broadcast",
+               &force_scalar_wakeup, FALSE, TRUE, NULL);
+  opt_reg_int(odb, "-tom:bench", "time this many runs of the selected and the generic engine",
+              &engine_bench_runs, 0, TRUE, NULL);
+  opt_reg_string(odb, "-tom:sweep", "also simulate every configuration listed in this file "
+                 "(one per line: ifq rs_int rs_fp fu_int fu_fp lat_int lat_fp [cdb [fetch dispatch]])",
+                 &sweep_file, NULL, TRUE, NULL);
+  opt_reg_string(odb, "-tom:sweep_out", "write the sweep results to this file (default: stderr)",
+                 &sweep_out_file, NULL, TRUE, NULL);
+  opt_reg_int(odb, "-tom:sweep_threads", "threads running the sweep (0 = one per processor)",
+              &sweep_threads, 0, TRUE, NULL);
+  opt_reg_flag(odb, "-tom:decode_thread", "decode the trace on a separate thread while it is simulated",
+               &decode_thread, TRUE, TRUE, NULL);
+  opt_reg_string(odb, "-tom:trace_out", "write the decoded trace to this file for -tom:replay",
+                 &trace_out_file, NULL, TRUE, NULL);
+  opt_reg_string(odb, "-tom:replay", "simulate the trace in this file (written with -tom:trace_out) "
+                 "instead of the one of the functional simulator",
+                 &replay_file, NULL, TRUE, NULL);
+  opt_reg_int(odb, "-tom:trace_block", "instructions per compressed block of -tom:trace_out "
+              "and -tom:stream_out (0 = uncompressed trace file, for mmap)",
+              &trace_block_insns, TRACE_BLOCK_INSNS, TRUE, NULL);
+  opt_reg_int(odb, "-tom:block_threads", "threads decompressing a replayed compressed trace "
+              "(0 = decompress on the simulator thread)",
+              &block_threads, BLOCK_THREADS, TRUE, NULL);
+  opt_reg_int(odb, "-tom:read_ahead", "blocks of a replayed compressed trace decompressed ahead",
+              &read_ahead_blocks, READ_AHEAD_BLOCKS, TRUE, NULL);
+  opt_reg_string(odb, "-tom:trace_cache", "directory of traces kept by program, arguments and "
+                 "instruction count, replayed instead of simulating the program again",
+                 &trace_cache_dir, NULL, TRUE, NULL);
+  opt_reg_string(odb, "-tom:stream_out", "send the decoded trace to this stream (a file or named pipe, "
+                 "or unix:PATH to connect to a Unix socket)",
+                 &stream_out_name, NULL, TRUE, NULL);
+  opt_reg_string(odb, "-tom:stream_in", "simulate the trace arriving on this stream (a file or named "
+                 "pipe, - for stdin, or unix:PATH to listen on a Unix socket) instead of the one of "
+                 "the functional simulator",
+                 &stream_in_name, NULL, TRUE, NULL);
+}
 
-  return doneCount == sim_insn;
+/* 
+ * Description: 
+ * 	Checks that a configuration describes a machine that can be simulated
+ * Inputs:
+ * 	cfg: the configuration
+ * Returns:
+ * 	None (exits through fatal() on a bad configuration)
+ */
+static void check_config(const tom_config_t* cfg) {
+  if (cfg->ifq_size < 1)
+    fatal("instruction queue size must be at least 1");
+  if (cfg->rs_int_size < 1 || cfg->rs_fp_size < 1)
+    fatal("there must be at least one reservation station of each class");
+  if (cfg->fu_int_size < 1 || cfg->fu_fp_size < 1)
+    fatal("there must be at least one functional unit of each class");
+  if (cfg->fu_int_latency < 1 || cfg->fu_fp_latency < 1)
+    fatal("functional unit latencies must be at least 1 cycle");
+  if (cfg->cdb_width < 1)
+    fatal("there must be at least one common data bus");
+  if (cfg->fetch_width < 1 || cfg->dispatch_width < 1)
+    fatal("fetch and dispatch widths must be at least 1");
+  if (TAG_COUNT(*cfg) >= FETCHED_TAG)
+    fatal("at most %d reservation stations and buses are supported", FETCHED_TAG - 1);
 }
 
 /* 
  * Description: 
- * 	Retires the instruction from writing to the Common Data Bus
+ * 	Compares two configurations
  * Inputs:
- * 	current_cycle: the cycle we are at
+ * 	a, b: the configurations
+ * Returns:
+ * 	True: if they describe the same machine
+ */
+static bool same_config(const tom_config_t* a, const tom_config_t* b) {
+  return a->ifq_size == b->ifq_size
+    && a->rs_int_size == b->rs_int_size
+    && a->rs_fp_size == b->rs_fp_size
+    && a->fu_int_size == b->fu_int_size
+    && a->fu_fp_size == b->fu_fp_size
+    && a->fu_int_latency == b->fu_int_latency
+    && a->fu_fp_latency == b->fu_fp_latency
+    && a->cdb_width == b->cdb_width
+    && a->fetch_width == b->fetch_width
+    && a->dispatch_width == b->dispatch_width;
+}
+
+/* DECODED TRACE */
+
+//The engine never looks at instruction_t: the trace is decoded once into compact records
+//holding only what the timing model needs, so no stage evaluates MD_OP_FLAGS.
+
+//class of a decoded instruction, in the order the pipeline classifies opcodes
+enum {
+  OPC_TRAP,         //dropped at fetch
+  OPC_BRANCH,       //leaves the pipeline at dispatch
+  OPC_FP,           //floating point functional unit, writes the CDB
+  OPC_STORE,        //integer functional unit, does not write the CDB
+  OPC_INT,          //integer functional unit, writes the CDB
+  OPC_UNKNOWN
+};
+
+//register field of a record that names no register
+#define NO_REG             0xff
+
+//registers have to fit in a record
+typedef char tom_reg_fits_record[MD_TOTAL_REGS <= NO_REG ? 1 : -1];
+
+//one decoded instruction
+typedef struct {
+  unsigned char op_class;
+  unsigned char r_in[3];
+  unsigned char r_out[2];
+  //distance back to the producer of each source operand (0 if it has none in the trace)
+  unsigned int producer_dist[3];
+} tom_record_t;
+
+//compressed trace file (see COMPRESSED TRACE FILES)
+typedef struct tom_block_file tom_block_file_t;
+
+//a decoded trace; records[i] is instruction i of the trace (records[0] is unused). A
+//trace read from a compressed file has no records, it is read through blocks instead.
+struct tom_trace {
+  tom_block_file_t* blocks;
+  tom_record_t* records;
+  counter_t num_insn;
+  //PC of each instruction, for traces read from a file (NULL otherwise)
+  const md_addr_t* pc;
+  //size of the file mapping the records live in (0 if they were decoded in memory)
+  size_t map_size;
+};
+
+//Decoding state: the producer of a source operand is the last earlier instruction writing
+//its register through the CDB. Dispatch is in order, so it is exactly the instruction a map
+//table would name at dispatch.
+typedef struct {
+  //last instruction writing each register (0 for none)
+  counter_t last_writer[MD_TOTAL_REGS];
+  //index of the last instruction decoded
+  counter_t index;
+} tom_decoder_t;
+
+/* 
+ * Description: 
+ * 	Decodes the next instruction of a trace into a compact record
+ * Inputs:
+ * 	decoder: the decoding state (zeroed before the first instruction)
+ * 	instr: the instruction
+ * 	rec: the record to fill in
  * Returns:
  * 	None
  */
-void CDB_To_retire(int current_cycle) {
+static void decode_instr(tom_decoder_t* decoder, const instruction_t* instr, tom_record_t* rec) {
+  const counter_t i = ++decoder->index;
+  enum md_opcode op = instr->op;
 
-  if (commonDataBus) {
-    for (int i = 0; i < 2; i++) {
-      if (map_table[commonDataBus->r_out[i]] == commonDataBus) {
-        map_table[commonDataBus->r_out[i]] = NULL;
-      }
-    }
-		for (int i = 0; i < RESERV_INT_SIZE; i++) {
-			for (int j = 0; j < 3; j++) {
-				if (reservINT[i]!=NULL && reservINT[i]->Q[j]!= NULL && reservINT[i]->Q[j] == commonDataBus) {
-					reservINT[i]->Q[j] = NULL;
-				}
-			}
-		}
-		for (int i = 0; i < RESERV_FP_SIZE; i++) {
-			for (int j = 0; j < 3; j++) {
-				if (reservFP[i]!=NULL && reservFP[i]->Q[j]!= NULL && reservFP[i]->Q[j] == commonDataBus) {
-					reservFP[i]->Q[j] = NULL;
-				}
-			}
-		}
-    commonDataBus = NULL;
-    doneCount++;
+  if (IS_TRAP(op))
+    rec->op_class = OPC_TRAP;
+  else if (IS_UNCOND_CTRL(op) || IS_COND_CTRL(op))
+    rec->op_class = OPC_BRANCH;
+  else if (USES_FP_FU(op))
+    rec->op_class = OPC_FP;
+  else if (IS_STORE(op))
+    rec->op_class = OPC_STORE;
+  else if (USES_INT_FU(op))
+    rec->op_class = OPC_INT;
+  else
+    rec->op_class = OPC_UNKNOWN;
+
+  for (int j = 0; j < 3; j++) {
+    rec->r_in[j] = instr->r_in[j] == DNA ? NO_REG : instr->r_in[j];
+    rec->producer_dist[j] = 0;
+  }
+  for (int j = 0; j < 2; j++) {
+    rec->r_out[j] = instr->r_out[j] == DNA ? NO_REG : instr->r_out[j];
   }
-}
 
-void free_stations(instruction_t *instr) {
-  if (USES_INT_FU(instr->op)) {
-    for (int i = 0; i < FU_INT_SIZE; i++) {
-      if (fuINT[i] == instr) {
-        fuINT[i] = NULL;
-        break;
-      }
-    }
-    for (int i = 0; i < RESERV_INT_SIZE; i++) {
-      if (reservINT[i] == instr) {
-        reservINT[i] = NULL;
-        break;
+  //only instructions in a reservation station read operands or produce results
+  if (rec->op_class == OPC_INT || rec->op_class == OPC_STORE || rec->op_class == OPC_FP) {
+    for (int j = 0; j < 3; j++) {
+      //a producer further back than a distance can hold has long retired
+      if (rec->r_in[j] != NO_REG && decoder->last_writer[rec->r_in[j]]
+          && i - decoder->last_writer[rec->r_in[j]] <= UINT_MAX) {
+        rec->producer_dist[j] = i - decoder->last_writer[rec->r_in[j]];
       }
     }
-  } else if (USES_FP_FU(instr->op)) {
-    for (int i = 0; i < FU_FP_SIZE; i++) {
-      if (fuFP[i] == instr) {
-        fuFP[i] = NULL;
-        break;
-      }
-    }
-    for (int i = 0; i < RESERV_FP_SIZE; i++) {
-      if (reservFP[i] == instr) {
-        reservFP[i] = NULL;
-        break;
+  }
+  if (rec->op_class == OPC_INT || rec->op_class == OPC_FP) {
+    for (int j = 0; j < 2; j++) {
+      if (rec->r_out[j] != NO_REG) {
+        decoder->last_writer[rec->r_out[j]] = i;
       }
     }
-  } else {
-    printf("Error: instruction not recognized\n");
-    assert(false);
   }
 }
 
+/* 
+ * Description: 
+ * 	Decodes a whole trace into compact records, so that several simulations can
+ *      share it
+ * Inputs:
+ *      trace: instruction trace with all the instructions executed
+ * 	num_insn: the number of instructions in the trace
+ * Returns:
+ * 	The decoded trace (to be released with tomasulo_trace_free)
+ */
+tom_trace_t* tomasulo_decode(instruction_trace_t* trace, counter_t num_insn) {
+  tom_trace_t* decoded = calloc(1, sizeof(tom_trace_t));
+  tom_decoder_t* decoder = calloc(1, sizeof(tom_decoder_t));
+  if (!decoded || !decoder)
+    fatal("out of virtual memory");
+  decoded->num_insn = num_insn;
+  decoded->records = calloc(num_insn + 1, sizeof(tom_record_t));
+  if (!decoded->records)
+    fatal("out of virtual memory");
+
+  for (counter_t i = 1; i <= num_insn; i++) {
+    decode_instr(decoder, get_instr(trace, i), &decoded->records[i]);
+  }
+  free(decoder);
+  return decoded;
+}
+
+/* TRACE FILES */
+
+//A trace file holds a decoded trace laid out the way it is used, so that it is simulated
+//straight from a read-only shared mapping: no functional simulation, no per-instruction
+//allocation, and concurrent runs share the pages. After the header come records[0..num_insn]
+//(records[0] is unused, as in memory) and then, padded to a multiple of the size of a PC
+//so that they are aligned in the mapping, pc[0..num_insn]. Files are only read on the
+//kind of host they were written on; the header records the layout to catch a mismatch.
+//Compressed trace files and trace streams (see COMPRESSED TRACE FILES and TRACE STREAMS)
+//share the header.
+#define TRACE_MAGIC        "TOMTRACE"
+#define BLOCK_TRACE_MAGIC  "TOMBLOCK"
+#define STREAM_TRACE_MAGIC "TOMSTRM"
+#define TRACE_VERSION      1
+#define TRACE_HEADER_SIZE  64
+
+typedef struct {
+  char magic[8];
+  unsigned int version;
+  //sizes of a record and of a PC in the file
+  unsigned int record_size;
+  unsigned int pc_size;
+  //instructions per block (compressed files only)
+  unsigned int block_insns;
+  qword_t num_insn;
+  //where the block index starts (compressed files only)
+  qword_t index_offset;
+} tom_file_header_t;
+
+typedef char tom_header_fits[sizeof(tom_file_header_t) <= TRACE_HEADER_SIZE ? 1 : -1];
+
+//where the PCs of an uncompressed trace file of n instructions start, and its size
+#define TRACE_PC_OFFSET(n) ((TRACE_HEADER_SIZE + ((qword_t)(n) + 1) * sizeof(tom_record_t) \
+                             + sizeof(md_addr_t) - 1) / sizeof(md_addr_t) * sizeof(md_addr_t))
+#define TRACE_FILE_SIZE(n) (TRACE_PC_OFFSET(n) + ((qword_t)(n) + 1) * sizeof(md_addr_t))
+
+//most instructions in a compressed block, so that BLOCK_BOUND and the tuple hash table fit
+#define MAX_BLOCK_INSNS    (INT_MAX / 64)
 
 /* 
  * Description: 
- * 	Moves an instruction from the execution stage to common data bus (if possible)
+ * 	Fills in the header of a trace file or stream
  * Inputs:
- * 	current_cycle: the cycle we are at
+ * 	header: the header (TRACE_HEADER_SIZE bytes)
+ * 	magic: the kind of trace
+ * 	num_insn: the number of instructions in the trace (0 if it is not known)
+ * 	block_insns: instructions per block (0 for an uncompressed file)
  * Returns:
  * 	None
  */
-void execute_To_CDB(int current_cycle) {
+static void trace_header_init(char* header, const char* magic, counter_t num_insn, int block_insns) {
+  tom_file_header_t* h = (tom_file_header_t*)header;
 
-  int oldest = -1;
-  instruction_t *oldest_instr = NULL;
-  
-  for (int i = 0; i < FU_INT_SIZE; i++) {
-    if (fuINT[i] && current_cycle >= fuINT[i]->tom_execute_cycle + FU_INT_LATENCY) {
-      if (IS_STORE(fuINT[i]->op)) {
-        free_stations(fuINT[i]);
-        doneCount++;
-      }
-			else if (oldest == -1 || fuINT[i]->index < oldest) {
-        oldest = fuINT[i]->index;
-        oldest_instr = fuINT[i];
-      }
-    }
+  memset(header, 0, TRACE_HEADER_SIZE);
+  memcpy(h->magic, magic, sizeof(h->magic));
+  h->version = TRACE_VERSION;
+  h->record_size = sizeof(tom_record_t);
+  h->pc_size = sizeof(md_addr_t);
+  h->block_insns = block_insns;
+  h->num_insn = num_insn;
+}
+
+/* 
+ * Description: 
+ * 	Checks that a header starts a kind of trace this host can read
+ * Inputs:
+ * 	header: the header (TRACE_HEADER_SIZE bytes)
+ * 	magic: the kind of trace expected
+ * Returns:
+ * 	NULL if it does, otherwise what is wrong with it
+ */
+static const char* trace_header_check(const char* header, const char* magic) {
+  const tom_file_header_t* h = (const tom_file_header_t*)header;
+
+  if (memcmp(h->magic, magic, sizeof(h->magic)) != 0 || h->version != TRACE_VERSION)
+    return "is not a trace of the expected kind";
+  if (h->record_size != sizeof(tom_record_t) || h->pc_size != sizeof(md_addr_t))
+    return "was written for another kind of host";
+  //compressed traces are cut into blocks
+  if (strcmp(magic, TRACE_MAGIC) != 0 && (h->block_insns == 0 || h->block_insns > MAX_BLOCK_INSNS))
+    return "is corrupt";
+  return NULL;
+}
+
+/* 
+ * Description: 
+ * 	Writes the decoded trace of a run to a trace file
+ * Inputs:
+ * 	fname: the trace file
+ *      trace: instruction trace with all the instructions executed
+ * 	num_insn: the number of instructions in the trace
+ * Returns:
+ * 	TRUE if the file was written (a file left by a failed write is not a trace)
+ */
+static int tomasulo_trace_write(const char* fname, instruction_trace_t* trace, counter_t num_insn) {
+  char header[TRACE_HEADER_SIZE];
+  tom_decoder_t* decoder = calloc(1, sizeof(tom_decoder_t));
+  tom_record_t rec;
+  md_addr_t pc = 0;
+  FILE* fd = fopen(fname, "wb");
+
+  if (!decoder)
+    fatal("out of virtual memory");
+  if (!fd) {
+    free(decoder);
+    return FALSE;
   }
-  if (fuFP[0] && current_cycle >= fuFP[0]->tom_execute_cycle + FU_FP_LATENCY) {
-    if (oldest == -1 || fuFP[0]->index < oldest) {
-      oldest = fuFP[0]->index;
-      oldest_instr = fuFP[0];
-    }
+
+  trace_header_init(header, TRACE_MAGIC, num_insn, 0);
+
+  memset(&rec, 0, sizeof(rec));
+  bool ok = fwrite(header, sizeof(header), 1, fd) == 1 && fwrite(&rec, sizeof(rec), 1, fd) == 1;
+  for (counter_t i = 1; ok && i <= num_insn; i++) {
+    decode_instr(decoder, get_instr(trace, i), &rec);
+    ok = fwrite(&rec, sizeof(rec), 1, fd) == 1;
   }
-  
-  if (oldest_instr) {
-    oldest_instr->tom_cdb_cycle = current_cycle;
-    free_stations(oldest_instr);
-    commonDataBus = oldest_instr;
+  //pad the records up to the PCs (pc is still 0)
+  const size_t padding = TRACE_PC_OFFSET(num_insn) - (TRACE_HEADER_SIZE + (num_insn + 1) * sizeof(tom_record_t));
+  ok = ok && (padding == 0 || fwrite(&pc, padding, 1, fd) == 1);
+  ok = ok && fwrite(&pc, sizeof(pc), 1, fd) == 1;
+  for (counter_t i = 1; ok && i <= num_insn; i++) {
+    pc = get_instr(trace, i)->pc;
+    ok = fwrite(&pc, sizeof(pc), 1, fd) == 1;
   }
+  ok = fclose(fd) == 0 && ok;
+  free(decoder);
+  return ok;
+}
+
+/* 
+ * Description: 
+ * 	Maps a trace file written by tomasulo_trace_write
+ * Inputs:
+ * 	fname: the trace file
+ * Returns:
+ * 	The decoded trace (to be released with tomasulo_trace_free)
+ */
+static tom_trace_t* tomasulo_trace_map(const char* fname) {
+  tom_trace_t* decoded = calloc(1, sizeof(tom_trace_t));
+  const tom_file_header_t* h;
+  const char* err;
+  struct stat st;
+  char* map;
+  int fd = open(fname, O_RDONLY);
+
+  if (!decoded)
+    fatal("out of virtual memory");
+  if (fd < 0 || fstat(fd, &st) != 0)
+    fatal("cannot open trace file `%s'", fname);
+  if (st.st_size < TRACE_HEADER_SIZE)
+    fatal("`%s' is not a trace file", fname);
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    fatal("cannot map trace file `%s'", fname);
+
+  h = (const tom_file_header_t*)map;
+  if ((err = trace_header_check(map, TRACE_MAGIC)))
+    fatal("trace file `%s' %s", fname, err);
+  if ((qword_t)st.st_size != TRACE_FILE_SIZE(h->num_insn))
+    fatal("trace file `%s' is truncated", fname);
+
+  //the records are read front to back
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
 
+  //the engine only reads the records, so they are used in place
+  decoded->num_insn = h->num_insn;
+  decoded->records = (tom_record_t*)(map + TRACE_HEADER_SIZE);
+  decoded->pc = (const md_addr_t*)(map + TRACE_PC_OFFSET(decoded->num_insn));
+  decoded->map_size = st.st_size;
+  return decoded;
+}
+
+/* TRACE SOURCES */
+
+//The engine reads the trace through a source, one decoded instruction at a time, and only
+//keeps the instructions it has fetched and not yet retired. A source only has to deliver
+//the instructions in order, so it can decode on the fly or read a trace that never fits
+//in memory at once. Concrete sources start with a tom_source_t. The engine does not need
+//the length of the trace: a run is over once the source is exhausted and every
+//instruction fetched from it is done.
+struct tom_source {
+  //fills in the next instruction; returns false once the trace is exhausted
+  bool (*read)(tom_source_t* source, tom_record_t* rec);
+  //number of instructions the source delivers (0 if it is not known in advance)
+  counter_t num_insn;
+};
+
+//source reading a decoded trace (which it only reads, so any number of them can share it)
+typedef struct {
+  tom_source_t base;
+  const tom_trace_t* trace;
+  //index of the next instruction
+  counter_t next;
+} tom_decoded_source_t;
+
+static bool decoded_source_read(tom_source_t* source, tom_record_t* rec) {
+  tom_decoded_source_t* src = (tom_decoded_source_t*)source;
+  if (src->next > src->trace->num_insn)
+    return false;
+  *rec = src->trace->records[src->next++];
+  return true;
 }
 
 /* 
  * Description: 
- * 	Moves instruction(s) from the issue to the execute stage (if possible). We prioritize old instructions
- *      (in program order) over new ones, if they both contend for the same functional unit.
- *      All RAW dependences need to have been resolved with stalls before an instruction enters execute.
+ * 	Sets up a source reading a decoded trace
  * Inputs:
- * 	current_cycle: the cycle we are at
+ * 	src: the source
+ * 	trace: the decoded trace
  * Returns:
- * 	None
+ * 	The source
  */
-void issue_To_execute(int current_cycle) {
+static tom_source_t* tomasulo_decoded_source(tom_decoded_source_t* src, const tom_trace_t* trace) {
+  src->base.read = decoded_source_read;
+  src->base.num_insn = trace->num_insn;
+  src->trace = trace;
+  src->next = 1;
+  return &src->base;
+}
 
-  /* ECE552: YOUR CODE GOES HERE */
-	for (int i=0; i<FU_INT_SIZE; i++) {
-		if (fuINT[i] == NULL) {
-			//function unit is available
-			bool found = false;
-			int j = 0;
-	    int oldest_rs_int = -1;
-			while (j < RESERV_INT_SIZE) {
-			//Find an int instruction that is not executed yet and is ready to be executed
-				if(reservINT[j]!=NULL && reservINT[j]->tom_execute_cycle==0 && reservINT[j]->Q[0]==NULL && reservINT[j]->Q[1]==NULL && reservINT[j]->Q[2]==NULL) {
-					if (!found) {
-						oldest_rs_int = j;
-						found = true;
-					}
-					else if (reservINT[j]->index<reservINT[oldest_rs_int]->index) {
-						oldest_rs_int = j;
-					}
-				}
-				j++;	
-			}
-			if (found) {
-				reservINT[oldest_rs_int]->tom_execute_cycle = current_cycle;
-			  fuINT[i] = reservINT[oldest_rs_int];
-			}
-		}
-	}				
-	for (int i=0; i<FU_FP_SIZE; i++) {
-		if (fuFP[i] == NULL) {
-			//function unit is available
-			bool found = false;
-			int j = 0;
-	    int oldest_rs_fp = -1;
-			while (j < RESERV_FP_SIZE) {
-			//Find an int instruction that is not executed yet and is ready to be executed
-				if(reservFP[j]!=NULL && reservFP[j]->tom_execute_cycle==0 && reservFP[j]->Q[0]==NULL && reservFP[j]->Q[1]==NULL && reservFP[j]->Q[2]==NULL) {
-					if (!found) {
-						oldest_rs_fp = j;
-						found = true;
-					}
-					else if (reservFP[j]->tom_dispatch_cycle<=reservFP[oldest_rs_fp]->tom_dispatch_cycle) {
-						oldest_rs_fp = j;
-					}
-				}
-				j++;	
-			}
-			if (found) {
-				reservFP[oldest_rs_fp]->tom_execute_cycle = current_cycle;
-			 	fuFP[i] = reservFP[oldest_rs_fp];	
-			}
-		}
-	}				
+//source decoding an instruction trace while it is read
+typedef struct {
+  tom_source_t base;
+  instruction_trace_t* trace;
+  tom_decoder_t decoder;
+} tom_trace_source_t;
+
+static bool trace_source_read(tom_source_t* source, tom_record_t* rec) {
+  tom_trace_source_t* src = (tom_trace_source_t*)source;
+  if (src->decoder.index >= src->base.num_insn)
+    return false;
+  decode_instr(&src->decoder, get_instr(src->trace, src->decoder.index + 1), rec);
+  return true;
 }
 
-void map_operands(instruction_t* instr) {
-  for (int i = 0; i < 3; i++) {
-    if (instr->r_in[i] != DNA) {
-      instr->Q[i] = map_table[instr->r_in[i]];
-    }
-  }
-  for (int i = 0; i < 2; i++) {
-    if (instr->r_out[i] != DNA) {
-      map_table[instr->r_out[i]] = instr;
-    }
+/* 
+ * Description: 
+ * 	Sets up a source decoding an instruction trace on the fly
+ * Inputs:
+ * 	src: the source
+ *      trace: instruction trace with all the instructions executed
+ * 	num_insn: the number of instructions in the trace
+ * Returns:
+ * 	The source
+ */
+static tom_source_t* tomasulo_trace_source(tom_trace_source_t* src, instruction_trace_t* trace, counter_t num_insn) {
+  memset(src, 0, sizeof(*src));
+  src->base.read = trace_source_read;
+  src->base.num_insn = num_insn;
+  src->trace = trace;
+  return &src->base;
+}
+
+//Source fed by another thread through a single-producer single-consumer ring of decoded
+//instructions. Each side only writes its own index, publishing it with a release store
+//that the other side reads with an acquire load, so neither side ever takes a lock. The
+//two sides are kept on separate cache lines.
+#define RING_SIZE          4096
+#define CACHE_LINE         64
+
+struct tom_ring_source {
+  tom_source_t base;
+  tom_record_t* slots;
+
+  char pad0[CACHE_LINE];
+  //producer side: number of instructions put, the last value of tail it has seen, and
+  //whether it is done
+  counter_t head;
+  counter_t cached_tail;
+  int closed;
+  tom_decoder_t decoder;
+
+  char pad1[CACHE_LINE];
+  //consumer side: number of instructions read, the last value of head it has seen
+  counter_t tail;
+  counter_t cached_head;
+  char pad2[CACHE_LINE];
+};
+
+static bool ring_source_read(tom_source_t* source, tom_record_t* rec) {
+  tom_ring_source_t* ring = (tom_ring_source_t*)source;
+
+  while (ring->tail == ring->cached_head) {
+    //head is published before closed, so it is read again once closed is seen
+    int closed = __atomic_load_n(&ring->closed, __ATOMIC_ACQUIRE);
+    ring->cached_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (ring->tail != ring->cached_head)
+      break;
+    if (closed)
+      return false;
+    sched_yield();
   }
+  *rec = ring->slots[ring->tail & (RING_SIZE - 1)];
+  __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+  return true;
 }
 
 /* 
  * Description: 
- * 	Moves instruction(s) from the dispatch stage to the issue stage
+ * 	Creates a source fed by another thread with tomasulo_ring_put
  * Inputs:
- * 	current_cycle: the cycle we are at
+ * 	num_insn: the number of instructions that will be put
  * Returns:
- * 	None
+ * 	The source (to be released with tomasulo_ring_free)
  */
-void dispatch_To_issue(int current_cycle) {
-  if(instr_queue_size > 0) {
-    instruction_t* head_instr = instr_queue[ifq_head];
-    enum md_opcode op = head_instr->op;
-    if (IS_UNCOND_CTRL(op) || IS_COND_CTRL(op)) {
-      ifq_head = (ifq_head + 1) % INSTR_QUEUE_SIZE;
-      instr_queue_size--;
-      doneCount++;
-      
-    } else if (USES_FP_FU(op)) {
-      for (int i = 0; i < RESERV_FP_SIZE; i++) {
-        if (reservFP[i] == NULL) {
-          reservFP[i] = head_instr;
-          head_instr->tom_issue_cycle = current_cycle;
-          ifq_head = (ifq_head + 1) % INSTR_QUEUE_SIZE;
-          instr_queue_size--;
-          map_operands(head_instr);
-					break;
-        }
-      }
-      
-    } else if (USES_INT_FU(op)) {
-      for (int i = 0; i < RESERV_INT_SIZE; i++) {
-        if (reservINT[i] == NULL) {
-          reservINT[i] = head_instr;
-          head_instr->tom_issue_cycle = current_cycle;
-          ifq_head = (ifq_head + 1) % INSTR_QUEUE_SIZE;
-          instr_queue_size--;
-          map_operands(head_instr);
-					break;
-        }
-      }
-      
-    } else {
-      //unrecognized instruction
-      printf("Unrecognized instruction\n");
-      assert(false);
-    }
+tom_ring_source_t* tomasulo_ring_create(counter_t num_insn) {
+  tom_ring_source_t* ring = calloc(1, sizeof(tom_ring_source_t));
+  if (!ring)
+    fatal("out of virtual memory");
+  ring->slots = calloc(RING_SIZE, sizeof(tom_record_t));
+  if (!ring->slots)
+    fatal("out of virtual memory");
+  ring->base.read = ring_source_read;
+  ring->base.num_insn = num_insn;
+  return ring;
+}
+
+//the side of a ring that runTomasulo_source reads
+tom_source_t* tomasulo_ring_source(tom_ring_source_t* ring) {
+  return &ring->base;
+}
 
+/* 
+ * Description: 
+ * 	Decodes the next instruction into the ring, waiting while the ring is full.
+ *      Only one thread may put instructions into a ring.
+ * Inputs:
+ * 	ring: the source
+ * 	instr: the instruction
+ * Returns:
+ * 	None
+ */
+void tomasulo_ring_put(tom_ring_source_t* ring, const instruction_t* instr) {
+  while (ring->head - ring->cached_tail == RING_SIZE) {
+    ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (ring->head - ring->cached_tail < RING_SIZE)
+      break;
+    sched_yield();
   }
+  decode_instr(&ring->decoder, instr, &ring->slots[ring->head & (RING_SIZE - 1)]);
+  __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
 }
 
 /* 
  * Description: 
- * 	Grabs an instruction from the instruction trace (if possible)
+ * 	Tells the reader of a ring that no more instructions will be put
  * Inputs:
- *      trace: instruction trace with all the instructions executed
+ * 	ring: the source
  * Returns:
  * 	None
  */
-void fetch(instruction_trace_t* trace) {
-  instruction_t* new_instr;
-  do {
-    fetch_index++;
-    new_instr = get_instr(trace, fetch_index);
-    if (IS_TRAP(new_instr->op)) {
-      doneCount++;
+void tomasulo_ring_close(tom_ring_source_t* ring) {
+  __atomic_store_n(&ring->closed, TRUE, __ATOMIC_RELEASE);
+}
+
+/* 
+ * Description: 
+ * 	Releases a ring source once both sides are done with it
+ * Inputs:
+ * 	ring: the source
+ * Returns:
+ * 	None
+ */
+void tomasulo_ring_free(tom_ring_source_t* ring) {
+  free(ring->slots);
+  free(ring);
+}
+
+//instructions a producer thread puts into a ring
+typedef struct {
+  tom_ring_source_t* ring;
+  instruction_trace_t* trace;
+  counter_t num_insn;
+} tom_producer_t;
+
+/* 
+ * Description: 
+ * 	Producer thread: decodes a trace into a ring
+ * Inputs:
+ * 	arg: the producer
+ * Returns:
+ * 	NULL
+ */
+static void* trace_producer(void* arg) {
+  tom_producer_t* producer = arg;
+
+  for (counter_t i = 1; i <= producer->num_insn; i++) {
+    tomasulo_ring_put(producer->ring, get_instr(producer->trace, i));
+  }
+  tomasulo_ring_close(producer->ring);
+  return NULL;
+}
+
+/* COMPRESSED TRACE FILES */
+
+//A compressed trace file is cut into blocks of block_insns instructions (the last one may
+//be shorter) that are compressed independently, followed by an index giving the offset of
+//each block, so any instruction is reached by decompressing a single block. A block holds
+//the number of distinct (class, registers) tuples in it and the tuples, 6 bytes each, then
+//for each instruction its tuple number, its three producer distances and the zigzag
+//difference of its PC from the previous one (from 0 in the block). Numbers are stored in
+//7 bits per byte. Producer distances are kept rather than recomputed from the registers,
+//so that a block does not depend on the ones before it.
+
+//bytes a block of n instructions may take: the tuples, and at most 10 bytes per number
+#define BLOCK_BOUND(n)     (10 + 6 * (size_t)(n) + 50 * (size_t)(n))
+
+struct tom_block_file {
+  //read with pread only, so readers on any thread can share it
+  int fd;
+  counter_t num_insn;
+  int block_insns;
+  counter_t num_blocks;
+  //offset of each block in the file, and of the end of the last one
+  qword_t* offsets;
+};
+
+TOM_INLINE unsigned char* put_varint(unsigned char* p, qword_t v) {
+  while (v >= 0x80) {
+    *p++ = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = (unsigned char)v;
+  return p;
+}
+
+TOM_INLINE bool get_varint(const unsigned char** p, const unsigned char* end, qword_t* v) {
+  qword_t value = 0;
+  for (int shift = 0; *p < end && shift < 64; shift += 7) {
+    unsigned char byte = *(*p)++;
+    value |= (qword_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *v = value;
+      return true;
     }
-  } while (IS_TRAP(new_instr->op));
+  }
+  return false;
+}
 
-  instr_queue[ifq_tail] = new_instr;
+//the class and registers of a record, packed into one number
+TOM_INLINE qword_t record_tuple(const tom_record_t* rec) {
+  return (qword_t)rec->op_class | (qword_t)rec->r_in[0] << 8 | (qword_t)rec->r_in[1] << 16
+         | (qword_t)rec->r_in[2] << 24 | (qword_t)rec->r_out[0] << 32 | (qword_t)rec->r_out[1] << 40;
 }
 
+//scratch space of the compressor, for blocks of up to block_insns instructions
+typedef struct {
+  int block_insns;
+  tom_record_t* recs;
+  md_addr_t* pc;
+  //distinct tuples, and the tuple number of each instruction
+  qword_t* dict;
+  int* codes;
+  //hash table of the tuples (tuple number + 1, 0 for an empty entry)
+  int* table;
+  int table_size;
+  unsigned char* out;
+} tom_block_encoder_t;
+
 /* 
  * Description: 
- * 	Calls fetch and dispatches an instruction at the same cycle (if possible)
+ * 	Allocates the scratch space of a compressor
  * Inputs:
- *      trace: instruction trace with all the instructions executed
- * 	current_cycle: the cycle we are at
+ * 	enc: the encoder
+ * 	block_insns: most instructions in a block (1 to MAX_BLOCK_INSNS)
  * Returns:
  * 	None
  */
-void fetch_To_dispatch(instruction_trace_t* trace, int current_cycle) {
-  if (instr_queue_size < INSTR_QUEUE_SIZE && fetch_index < sim_num_insn) {
-    fetch(trace);
-    instr_queue[ifq_tail]->tom_dispatch_cycle = current_cycle;
-    ifq_tail = (ifq_tail+1) % INSTR_QUEUE_SIZE;
-    instr_queue_size++;
-  }
+static void block_encoder_init(tom_block_encoder_t* enc, int block_insns) {
+  if (block_insns <= 0 || block_insns > MAX_BLOCK_INSNS)
+    fatal("compressed traces need between 1 and %d instructions per block", MAX_BLOCK_INSNS);
+  enc->block_insns = block_insns;
+  for (enc->table_size = 1; enc->table_size < 2 * block_insns; enc->table_size *= 2)
+    ;
+  enc->recs = calloc(block_insns, sizeof(tom_record_t));
+  enc->pc = calloc(block_insns, sizeof(md_addr_t));
+  enc->dict = calloc(block_insns, sizeof(qword_t));
+  enc->codes = calloc(block_insns, sizeof(int));
+  enc->table = calloc(enc->table_size, sizeof(int));
+  enc->out = malloc(BLOCK_BOUND(block_insns));
+  if (!enc->recs || !enc->pc || !enc->dict || !enc->codes || !enc->table || !enc->out)
+    fatal("out of virtual memory");
+}
+
+static void block_encoder_free(tom_block_encoder_t* enc) {
+  free(enc->recs);
+  free(enc->pc);
+  free(enc->dict);
+  free(enc->codes);
+  free(enc->table);
+  free(enc->out);
 }
 
 /* 
  * Description: 
- * 	Performs a cycle-by-cycle simulation of the 4-stage pipeline
+ * 	Compresses the instructions held by an encoder into its output buffer
  * Inputs:
- *      trace: instruction trace with all the instructions executed
+ * 	enc: the encoder
+ * 	n: number of instructions
  * Returns:
- * 	The total number of cycles it takes to execute the instructions.
- * Extra Notes:
- * 	sim_num_insn: the number of instructions in the trace
+ * 	The size of the block
  */
-counter_t runTomasulo(instruction_trace_t* trace)
-{
-  instruction_t* table = trace->table;
-  //initialize instruction queue
+static size_t encode_block(tom_block_encoder_t* enc, int n) {
+  const int mask = enc->table_size - 1;
+  unsigned char* p = enc->out;
+  md_addr_t last_pc = 0;
+  int tuples = 0;
   int i;
-  for (i = 0; i < INSTR_QUEUE_SIZE; i++) {
-    instr_queue[i] = NULL;
+
+  memset(enc->table, 0, enc->table_size * sizeof(int));
+  for (i = 0; i < n; i++) {
+    qword_t tuple = record_tuple(&enc->recs[i]);
+    int h = (int)((tuple * 0x9e3779b97f4a7c15ULL) >> 40) & mask;
+    while (enc->table[h] && enc->dict[enc->table[h] - 1] != tuple) {
+      h = (h + 1) & mask;
+    }
+    if (!enc->table[h]) {
+      enc->dict[tuples] = tuple;
+      enc->table[h] = ++tuples;
+    }
+    enc->codes[i] = enc->table[h] - 1;
   }
 
-  //initialize reservation stations
-  for (i = 0; i < RESERV_INT_SIZE; i++) {
-      reservINT[i] = NULL;
+  p = put_varint(p, tuples);
+  for (i = 0; i < tuples; i++) {
+    for (int b = 0; b < 6; b++) {
+      *p++ = (unsigned char)(enc->dict[i] >> (8 * b));
+    }
+  }
+  for (i = 0; i < n; i++) {
+    sqword_t delta = (sqword_t)((qword_t)enc->pc[i] - (qword_t)last_pc);
+    p = put_varint(p, enc->codes[i]);
+    for (int j = 0; j < 3; j++) {
+      p = put_varint(p, enc->recs[i].producer_dist[j]);
+    }
+    p = put_varint(p, ((qword_t)delta << 1) ^ (qword_t)(delta >> 63));
+    last_pc = enc->pc[i];
   }
+  return (size_t)(p - enc->out);
+}
+
+/* 
+ * Description: 
+ * 	Decompresses a block
+ * Inputs:
+ * 	in: the block
+ * 	size: its size in bytes
+ * 	n: number of instructions in it
+ * 	recs: where the instructions are written
+ * 	pc: where their PCs are written
+ * 	dict: scratch space of n entries
+ * Returns:
+ * 	FALSE if the block is corrupt
+ */
+static bool decode_block(const unsigned char* in, size_t size, int n, tom_record_t* recs, md_addr_t* pc,
+                         qword_t* dict) {
+  const unsigned char* p = in;
+  const unsigned char* end = in + size;
+  md_addr_t last_pc = 0;
+  qword_t tuples, v;
+  int i;
 
-  for(i = 0; i < RESERV_FP_SIZE; i++) {
-      reservFP[i] = NULL;
+  if (!get_varint(&p, end, &tuples) || tuples > (qword_t)n || (qword_t)(end - p) < 6 * tuples)
+    return false;
+  for (i = 0; i < (int)tuples; i++) {
+    dict[i] = 0;
+    for (int b = 0; b < 6; b++) {
+      dict[i] |= (qword_t)*p++ << (8 * b);
+    }
+  }
+  for (i = 0; i < n; i++) {
+    tom_record_t* rec = &recs[i];
+    if (!get_varint(&p, end, &v) || v >= tuples)
+      return false;
+    rec->op_class = (unsigned char)dict[v];
+    rec->r_in[0] = (unsigned char)(dict[v] >> 8);
+    rec->r_in[1] = (unsigned char)(dict[v] >> 16);
+    rec->r_in[2] = (unsigned char)(dict[v] >> 24);
+    rec->r_out[0] = (unsigned char)(dict[v] >> 32);
+    rec->r_out[1] = (unsigned char)(dict[v] >> 40);
+    for (int j = 0; j < 3; j++) {
+      if (!get_varint(&p, end, &v) || v > UINT_MAX)
+        return false;
+      rec->producer_dist[j] = (unsigned int)v;
+    }
+    if (!get_varint(&p, end, &v))
+      return false;
+    last_pc = (md_addr_t)((qword_t)last_pc + ((v >> 1) ^ -(v & 1)));
+    pc[i] = last_pc;
   }
+  return p == end;
+}
+
+/* 
+ * Description: 
+ * 	Writes the decoded trace of a run to a compressed trace file
+ * Inputs:
+ * 	fname: the trace file
+ *      trace: instruction trace with all the instructions executed
+ * 	num_insn: the number of instructions in the trace
+ * 	block_insns: instructions per block
+ * Returns:
+ * 	TRUE if the file was written (a file left by a failed write is not a trace)
+ */
+static int tomasulo_trace_write_blocks(const char* fname, instruction_trace_t* trace, counter_t num_insn,
+                                        int block_insns) {
+  char header[TRACE_HEADER_SIZE];
+  tom_file_header_t* h = (tom_file_header_t*)header;
+  tom_decoder_t* decoder;
+  qword_t* offsets;
+  counter_t num_blocks;
+  tom_block_encoder_t enc;
+  FILE* fd;
+
+  block_encoder_init(&enc, block_insns);
+  num_blocks = (num_insn + block_insns - 1) / block_insns;
+  decoder = calloc(1, sizeof(tom_decoder_t));
+  offsets = calloc(num_blocks + 1, sizeof(qword_t));
+  if (!decoder || !offsets)
+    fatal("out of virtual memory");
+  fd = fopen(fname, "wb");
 
-  //initialize functional units
-  for (i = 0; i < FU_INT_SIZE; i++) {
-    fuINT[i] = NULL;
+  trace_header_init(header, BLOCK_TRACE_MAGIC, num_insn, block_insns);
+
+  //the header is written again once the index offset is known
+  bool ok = fd && fwrite(header, sizeof(header), 1, fd) == 1;
+  offsets[0] = TRACE_HEADER_SIZE;
+  for (counter_t b = 0; ok && b < num_blocks; b++) {
+    const counter_t first = b * block_insns + 1;
+    const int n = num_insn - first + 1 < block_insns ? (int)(num_insn - first + 1) : block_insns;
+    for (int i = 0; i < n; i++) {
+      const instruction_t* instr = get_instr(trace, first + i);
+      decode_instr(decoder, instr, &enc.recs[i]);
+      enc.pc[i] = instr->pc;
+    }
+    size_t size = encode_block(&enc, n);
+    ok = fwrite(enc.out, size, 1, fd) == 1;
+    offsets[b + 1] = offsets[b] + size;
   }
+  h->index_offset = offsets[num_blocks];
+  ok = ok && fwrite(offsets, sizeof(qword_t), num_blocks + 1, fd) == (size_t)(num_blocks + 1);
+  ok = ok && fseek(fd, 0, SEEK_SET) == 0 && fwrite(header, sizeof(header), 1, fd) == 1;
+  if (fd)
+    ok = fclose(fd) == 0 && ok;
+
+  block_encoder_free(&enc);
+  free(offsets);
+  free(decoder);
+  return ok;
+}
+
+/* 
+ * Description: 
+ * 	Opens a compressed trace file and reads its index
+ * Inputs:
+ * 	fname: the trace file
+ * Returns:
+ * 	The file (to be released with block_file_close)
+ */
+static tom_block_file_t* block_file_open(const char* fname) {
+  tom_block_file_t* file = calloc(1, sizeof(tom_block_file_t));
+  char header[TRACE_HEADER_SIZE];
+  const tom_file_header_t* h = (const tom_file_header_t*)header;
+  const char* err;
+  struct stat st;
+
+  if (!file)
+    fatal("out of virtual memory");
+  file->fd = open(fname, O_RDONLY);
+  if (file->fd < 0 || fstat(file->fd, &st) != 0)
+    fatal("cannot open trace file `%s'", fname);
+  if (pread(file->fd, header, sizeof(header), 0) != sizeof(header))
+    fatal("trace file `%s' is truncated", fname);
+  if ((err = trace_header_check(header, BLOCK_TRACE_MAGIC)))
+    fatal("trace file `%s' %s", fname, err);
+#ifdef POSIX_FADV_SEQUENTIAL
+  //blocks are mostly read front to back
+  posix_fadvise(file->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+  file->num_insn = h->num_insn;
+  file->block_insns = h->block_insns;
+  file->num_blocks = (file->num_insn + file->block_insns - 1) / file->block_insns;
+  file->offsets = calloc(file->num_blocks + 1, sizeof(qword_t));
+  if (!file->offsets)
+    fatal("out of virtual memory");
+  if ((qword_t)st.st_size != h->index_offset + (file->num_blocks + 1) * sizeof(qword_t))
+    fatal("trace file `%s' is truncated", fname);
 
-  for (i = 0; i < FU_FP_SIZE; i++) {
-    fuFP[i] = NULL;
+  size_t index_size = (file->num_blocks + 1) * sizeof(qword_t);
+  if (pread(file->fd, file->offsets, index_size, h->index_offset) != (ssize_t)index_size
+      || file->offsets[0] != TRACE_HEADER_SIZE || file->offsets[file->num_blocks] != h->index_offset)
+    fatal("trace file `%s' is corrupt", fname);
+  for (counter_t b = 0; b < file->num_blocks; b++) {
+    if (file->offsets[b + 1] < file->offsets[b]
+        || file->offsets[b + 1] - file->offsets[b] > BLOCK_BOUND(file->block_insns))
+      fatal("trace file `%s' is corrupt", fname);
   }
+  return file;
+}
+
+static void block_file_close(tom_block_file_t* file) {
+  close(file->fd);
+  free(file->offsets);
+  free(file);
+}
+
+//number of instructions in a block
+TOM_INLINE int block_length(const tom_block_file_t* file, counter_t block) {
+  const counter_t left = file->num_insn - block * file->block_insns;
+  return left < file->block_insns ? (int)left : file->block_insns;
+}
+
+/* 
+ * Description: 
+ * 	Reads and decompresses a block
+ * Inputs:
+ * 	file: the compressed trace file
+ * 	block: the block number
+ * 	buf: scratch space for the compressed block (BLOCK_BOUND(block_insns) bytes)
+ * 	dict: decompression scratch space (block_insns entries)
+ * 	records: where the instructions are written
+ * 	pc: where their PCs are written
+ * Returns:
+ * 	None
+ */
+static void read_block(const tom_block_file_t* file, counter_t block, unsigned char* buf, qword_t* dict,
+                       tom_record_t* records, md_addr_t* pc) {
+  const size_t size = file->offsets[block + 1] - file->offsets[block];
+  if (pread(file->fd, buf, size, file->offsets[block]) != (ssize_t)size)
+    fatal("cannot read trace block %lld", (long long)block);
+  if (!decode_block(buf, size, block_length(file, block), records, pc, dict))
+    fatal("trace block %lld is corrupt", (long long)block);
+}
+
+//source reading a compressed trace file front to back, one block at a time
+typedef struct {
+  tom_source_t base;
+  const tom_block_file_t* file;
+  //block held in records and pc (-1 before the first one)
+  counter_t block;
+  tom_record_t* records;
+  md_addr_t* pc;
+  //compressed block being read, and decompression scratch space
+  unsigned char* buf;
+  qword_t* dict;
+  //index of the next instruction
+  counter_t next;
+} tom_block_source_t;
 
-  //initialize map_table to no producers
-  int reg;
-  for (reg = 0; reg < MD_TOTAL_REGS; reg++) {
-    map_table[reg] = NULL;
+static bool block_source_read(tom_source_t* source, tom_record_t* rec) {
+  tom_block_source_t* src = (tom_block_source_t*)source;
+  const int block_insns = src->file->block_insns;
+  if (src->next > src->base.num_insn)
+    return false;
+
+  const counter_t block = (src->next - 1) / block_insns;
+  if (src->block != block) {
+    read_block(src->file, block, src->buf, src->dict, src->records, src->pc);
+    src->block = block;
   }
-  int cycle = 1;  
-  while (true) {
+  *rec = src->records[(src->next - 1) % block_insns];
+  src->next++;
+  return true;
+}
+
+/* 
+ * Description: 
+ * 	Sets up a source reading a compressed trace file
+ * Inputs:
+ * 	src: the source (to be released with tomasulo_block_source_close)
+ * 	file: the compressed trace file
+ * Returns:
+ * 	The source
+ */
+static tom_source_t* tomasulo_block_source(tom_block_source_t* src, const tom_block_file_t* file) {
+  memset(src, 0, sizeof(*src));
+  src->base.read = block_source_read;
+  src->base.num_insn = file->num_insn;
+  src->file = file;
+  src->block = -1;
+  src->next = 1;
+  src->records = calloc(file->block_insns, sizeof(tom_record_t));
+  src->pc = calloc(file->block_insns, sizeof(md_addr_t));
+  src->buf = malloc(BLOCK_BOUND(file->block_insns));
+  src->dict = calloc(file->block_insns, sizeof(qword_t));
+  if (!src->records || !src->pc || !src->buf || !src->dict)
+    fatal("out of virtual memory");
+  return &src->base;
+}
+
+static void tomasulo_block_source_close(tom_block_source_t* src) {
+  free(src->records);
+  free(src->pc);
+  free(src->buf);
+  free(src->dict);
+}
+
+//Source reading a compressed trace file whose blocks are decompressed ahead of it by helper
+//threads, so that fetch only waits if the helpers fall behind. Block b goes to slot
+//b % read_ahead. A helper claims the next block, waits for its slot to be handed back,
+//decompresses the block into it and publishes it; the reader waits for the block it needs
+//and hands the slot back once it moves on to the next block. Blocks and slots change hands
+//through release stores and acquire loads, so the reader never takes a lock to get a
+//block; it only takes it to wake up helpers, when some are waiting for a slot.
+typedef struct {
+  //next block this slot may receive
+  counter_t free_for;
+  //block the slot holds once it has been decompressed (-1 before the first one)
+  counter_t ready;
+  tom_record_t* records;
+  md_addr_t* pc;
+  char pad[CACHE_LINE];
+} tom_prefetch_slot_t;
+
+typedef struct {
+  tom_source_t base;
+  const tom_block_file_t* file;
+  int read_ahead;
+  tom_prefetch_slot_t* slots;
+
+  //next block for a helper to claim, and whether the helpers have to quit
+  counter_t next_block;
+  int stop;
+  //helpers waiting for a slot sleep here, and how many of them there are
+  pthread_mutex_t lock;
+  pthread_cond_t slot_freed;
+  int waiting;
+  int threads;
+  pthread_t* pool;
+
+  char pad[CACHE_LINE];
+  //reader side: block being read, and index of the next instruction
+  const tom_prefetch_slot_t* current;
+  counter_t current_block;
+  counter_t next;
+} tom_prefetch_source_t;
+
+/* 
+ * Description: 
+ * 	Helper thread: decompresses the blocks it claims into their slots
+ * Inputs:
+ * 	arg: the source
+ * Returns:
+ * 	NULL
+ */
+static void* block_prefetcher(void* arg) {
+  tom_prefetch_source_t* src = arg;
+  const tom_block_file_t* file = src->file;
+  unsigned char* buf = malloc(BLOCK_BOUND(file->block_insns));
+  qword_t* dict = calloc(file->block_insns, sizeof(qword_t));
+
+  if (!buf || !dict)
+    fatal("out of virtual memory");
+
+  while (true) {
+    const counter_t block = __atomic_fetch_add(&src->next_block, 1, __ATOMIC_RELAXED);
+    if (block >= file->num_blocks)
+      break;
+    tom_prefetch_slot_t* slot = &src->slots[block % src->read_ahead];
+
+#ifdef POSIX_FADV_WILLNEED
+    //have the kernel read the blocks after the window while this one is decompressed
+    const counter_t last = block + src->read_ahead < file->num_blocks ? block + src->read_ahead : file->num_blocks;
+    posix_fadvise(file->fd, file->offsets[block], file->offsets[last] - file->offsets[block], POSIX_FADV_WILLNEED);
+#endif
+
+    if (__atomic_load_n(&slot->free_for, __ATOMIC_ACQUIRE) != block) {
+      pthread_mutex_lock(&src->lock);
+      //counted before the slot is checked again, pairing with the reader in prefetch_source_read
+      __atomic_add_fetch(&src->waiting, 1, __ATOMIC_SEQ_CST);
+      while (__atomic_load_n(&slot->free_for, __ATOMIC_SEQ_CST) != block && !src->stop) {
+        pthread_cond_wait(&src->slot_freed, &src->lock);
+      }
+      __atomic_sub_fetch(&src->waiting, 1, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock(&src->lock);
+    }
+    if (__atomic_load_n(&src->stop, __ATOMIC_ACQUIRE))
+      break;
+
+    read_block(file, block, buf, dict, slot->records, slot->pc);
+    __atomic_store_n(&slot->ready, block, __ATOMIC_RELEASE);
+  }
+
+  free(buf);
+  free(dict);
+  return NULL;
+}
+
+static bool prefetch_source_read(tom_source_t* source, tom_record_t* rec) {
+  tom_prefetch_source_t* src = (tom_prefetch_source_t*)source;
+  const int block_insns = src->file->block_insns;
+  if (src->next > src->base.num_insn)
+    return false;
+
+  const counter_t block = (src->next - 1) / block_insns;
+  if (!src->current || src->current_block != block) {
+    if (src->current) {
+      //hand the slot back for the block read_ahead blocks later
+      tom_prefetch_slot_t* done = &src->slots[src->current_block % src->read_ahead];
+      //either a helper about to sleep sees the slot, or the reader sees the helper waiting
+      __atomic_store_n(&done->free_for, src->current_block + src->read_ahead, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&src->waiting, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&src->lock);
+        pthread_cond_broadcast(&src->slot_freed);
+        pthread_mutex_unlock(&src->lock);
+      }
+    }
+    const tom_prefetch_slot_t* slot = &src->slots[block % src->read_ahead];
+    while (__atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE) != block) {
+      sched_yield();
+    }
+    src->current = slot;
+    src->current_block = block;
+  }
+  *rec = src->current->records[(src->next - 1) % block_insns];
+  src->next++;
+  return true;
+}
+
+/* 
+ * Description: 
+ * 	Sets up a source reading a compressed trace file with helper threads
+ * Inputs:
+ * 	src: the source (to be released with tomasulo_prefetch_source_close)
+ * 	file: the compressed trace file
+ * 	threads: number of helper threads
+ * 	read_ahead: number of blocks decompressed ahead of the reader
+ * Returns:
+ * 	The source
+ */
+static tom_source_t* tomasulo_prefetch_source(tom_prefetch_source_t* src, const tom_block_file_t* file,
+                                              int threads, int read_ahead) {
+  if (read_ahead < 1)
+    fatal("the trace read-ahead must be at least one block");
+
+  memset(src, 0, sizeof(*src));
+  src->base.read = prefetch_source_read;
+  src->base.num_insn = file->num_insn;
+  src->file = file;
+  src->read_ahead = read_ahead;
+  src->threads = threads;
+  src->next = 1;
+
+  src->slots = calloc(read_ahead, sizeof(tom_prefetch_slot_t));
+  src->pool = calloc(threads, sizeof(pthread_t));
+  if (!src->slots || !src->pool)
+    fatal("out of virtual memory");
+  for (int i = 0; i < read_ahead; i++) {
+    src->slots[i].free_for = i;
+    src->slots[i].ready = -1;
+    src->slots[i].records = calloc(file->block_insns, sizeof(tom_record_t));
+    src->slots[i].pc = calloc(file->block_insns, sizeof(md_addr_t));
+    if (!src->slots[i].records || !src->slots[i].pc)
+      fatal("out of virtual memory");
+  }
+  pthread_mutex_init(&src->lock, NULL);
+  pthread_cond_init(&src->slot_freed, NULL);
+
+  for (int i = 0; i < threads; i++) {
+    if (pthread_create(&src->pool[i], NULL, block_prefetcher, src))
+      fatal("cannot create trace decompression thread");
+  }
+  return &src->base;
+}
+
+static void tomasulo_prefetch_source_close(tom_prefetch_source_t* src) {
+  pthread_mutex_lock(&src->lock);
+  __atomic_store_n(&src->stop, TRUE, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&src->slot_freed);
+  pthread_mutex_unlock(&src->lock);
+  for (int i = 0; i < src->threads; i++) {
+    pthread_join(src->pool[i], NULL);
+  }
+
+  for (int i = 0; i < src->read_ahead; i++) {
+    free(src->slots[i].records);
+    free(src->slots[i].pc);
+  }
+  free(src->slots);
+  free(src->pool);
+  pthread_mutex_destroy(&src->lock);
+  pthread_cond_destroy(&src->slot_freed);
+}
+
+/* 
+ * Description: 
+ * 	Opens a trace file of either kind: an uncompressed one is mapped, a compressed
+ *      one is read a block at a time
+ * Inputs:
+ * 	fname: the trace file
+ * Returns:
+ * 	The trace (to be released with tomasulo_trace_free)
+ */
+tom_trace_t* tomasulo_trace_open(const char* fname) {
+  char magic[8];
+  int fd = open(fname, O_RDONLY);
+  bool blocks;
+
+  if (fd < 0)
+    fatal("cannot open trace file `%s'", fname);
+  blocks = pread(fd, magic, sizeof(magic), 0) == sizeof(magic)
+           && memcmp(magic, BLOCK_TRACE_MAGIC, sizeof(magic)) == 0;
+  close(fd);
+  if (!blocks)
+    return tomasulo_trace_map(fname);
+
+  tom_trace_t* decoded = calloc(1, sizeof(tom_trace_t));
+  if (!decoded)
+    fatal("out of virtual memory");
+  decoded->blocks = block_file_open(fname);
+  decoded->num_insn = decoded->blocks->num_insn;
+  return decoded;
+}
+
+/* 
+ * Description: 
+ * 	Releases a decoded trace
+ * Inputs:
+ * 	decoded: the decoded trace
+ * Returns:
+ * 	None
+ */
+void tomasulo_trace_free(tom_trace_t* decoded) {
+  if (decoded->blocks)
+    block_file_close(decoded->blocks);
+  else if (decoded->map_size)
+    munmap((char*)decoded->records - TRACE_HEADER_SIZE, decoded->map_size);
+  else
+    free(decoded->records);
+  free(decoded);
+}
+
+/* TRACE STREAMS */
+
+//A trace stream carries a trace from one process to another through a pipe or a socket,
+//as it is produced, so neither side needs to know its length or to keep it. It is the
+//header of a compressed trace file (with a length of 0) followed by frames, each one the
+//number of instructions in it and the size of its block (both unsigned ints), then the
+//block compressed as in a file. The stream ends with an empty frame; a stream closed
+//without one is cut short.
+//A stream is named by a path (a file or a named pipe), "-" for the standard input or
+//output, or "unix:PATH" for a Unix socket, which the simulator listens on and the
+//producer connects to.
+#define UNIX_PREFIX        "unix:"
+
+/* 
+ * Description: 
+ * 	Opens a trace stream
+ * Inputs:
+ * 	name: the stream (see TRACE STREAMS)
+ * 	write: TRUE for the producer side, FALSE for the simulator side
+ * Returns:
+ * 	The stream
+ */
+static FILE* stream_open(const char* name, int write) {
+  FILE* fd;
+
+  if (strcmp(name, "-") == 0) {
+    fd = write ? stdout : stdin;
+  } else if (strncmp(name, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0) {
+    const char* path = name + strlen(UNIX_PREFIX);
+    struct sockaddr_un addr;
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    int conn;
+
+    if (sock < 0 || strlen(path) >= sizeof(addr.sun_path))
+      fatal("cannot open trace stream `%s'", name);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (write) {
+      if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+        fatal("cannot connect to trace stream `%s'", name);
+      conn = sock;
+    } else {
+      struct stat st;
+      //the simulator serves a single producer, and the socket is gone once it is connected.
+      //Only a socket left by an earlier run is removed, never a file named by mistake.
+      if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode))
+          fatal("trace stream `%s' names a file that is not a socket", name);
+        unlink(path);
+      }
+      if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(sock, 1) != 0)
+        fatal("cannot listen on trace stream `%s'", name);
+      conn = accept(sock, NULL, NULL);
+      close(sock);
+      unlink(path);
+      if (conn < 0)
+        fatal("cannot accept on trace stream `%s'", name);
+    }
+    fd = fdopen(conn, write ? "wb" : "rb");
+  } else {
+    fd = fopen(name, write ? "wb" : "rb");
+  }
+  if (!fd)
+    fatal("cannot open trace stream `%s'", name);
+  return fd;
+}
+
+//producer side of a trace stream
+struct tom_stream_writer {
+  FILE* fd;
+  tom_decoder_t decoder;
+  tom_block_encoder_t enc;
+  //instructions waiting in the encoder
+  int count;
+};
+
+/* 
+ * Description: 
+ * 	Opens a trace stream to put instructions into
+ * Inputs:
+ * 	name: the stream (see TRACE STREAMS)
+ * 	block_insns: most instructions sent in one frame
+ * Returns:
+ * 	The writer (to be closed with tomasulo_stream_writer_close)
+ */
+tom_stream_writer_t* tomasulo_stream_writer_open(const char* name, int block_insns) {
+  tom_stream_writer_t* w = calloc(1, sizeof(tom_stream_writer_t));
+  char header[TRACE_HEADER_SIZE];
+
+  if (!w)
+    fatal("out of virtual memory");
+  block_encoder_init(&w->enc, block_insns);
+  w->fd = stream_open(name, TRUE);
+
+  trace_header_init(header, STREAM_TRACE_MAGIC, 0, block_insns);
+  if (fwrite(header, sizeof(header), 1, w->fd) != 1)
+    fatal("cannot write trace stream `%s'", name);
+  return w;
+}
+
+/* 
+ * Description: 
+ * 	Sends the instructions waiting in a writer as one frame
+ * Inputs:
+ * 	w: the writer
+ * Returns:
+ * 	None
+ */
+static void stream_flush(tom_stream_writer_t* w) {
+  unsigned int frame[2];
+
+  frame[0] = w->count;
+  frame[1] = w->count ? (unsigned int)encode_block(&w->enc, w->count) : 0;
+  if (fwrite(frame, sizeof(frame), 1, w->fd) != 1 || (frame[1] && fwrite(w->enc.out, frame[1], 1, w->fd) != 1))
+    fatal("cannot write trace stream");
+  w->count = 0;
+}
+
+/* 
+ * Description: 
+ * 	Puts the next instruction into a trace stream
+ * Inputs:
+ * 	w: the writer
+ * 	instr: the instruction
+ * Returns:
+ * 	None
+ */
+void tomasulo_stream_put(tom_stream_writer_t* w, const instruction_t* instr) {
+  decode_instr(&w->decoder, instr, &w->enc.recs[w->count]);
+  w->enc.pc[w->count] = instr->pc;
+  if (++w->count == w->enc.block_insns) {
+    stream_flush(w);
+  }
+}
+
+/* 
+ * Description: 
+ * 	Ends a trace stream and releases its writer
+ * Inputs:
+ * 	w: the writer
+ * Returns:
+ * 	None
+ */
+void tomasulo_stream_writer_close(tom_stream_writer_t* w) {
+  if (w->count) {
+    stream_flush(w);
+  }
+  //the empty frame
+  stream_flush(w);
+  if (fflush(w->fd) != 0 || (w->fd != stdout && fclose(w->fd) != 0))
+    fatal("cannot write trace stream");
+
+  block_encoder_free(&w->enc);
+  free(w);
+}
+
+//source reading a trace stream
+typedef struct {
+  tom_source_t base;
+  FILE* fd;
+  int block_insns;
+  //the frame being read: its instructions, how many there are and the next one
+  tom_record_t* records;
+  md_addr_t* pc;
+  int count;
+  int next;
+  //the stream has ended
+  bool ended;
+  //compressed frame, and decompression scratch space
+  unsigned char* buf;
+  qword_t* dict;
+} tom_stream_source_t;
+
+static bool stream_source_read(tom_source_t* source, tom_record_t* rec) {
+  tom_stream_source_t* src = (tom_stream_source_t*)source;
+
+  while (src->next == src->count) {
+    unsigned int frame[2];
+    if (src->ended)
+      return false;
+    //only the empty frame ends a stream: closing it before means the producer died
+    if (fread(frame, sizeof(frame), 1, src->fd) != 1)
+      fatal("trace stream was closed without its end frame");
+    if (frame[0] == 0) {
+      src->ended = true;
+      return false;
+    }
+    if (frame[0] > (unsigned int)src->block_insns || frame[1] > BLOCK_BOUND(src->block_insns)
+        || fread(src->buf, 1, frame[1], src->fd) != frame[1]
+        || !decode_block(src->buf, frame[1], frame[0], src->records, src->pc, src->dict))
+      fatal("trace stream is corrupt");
+    src->count = frame[0];
+    src->next = 0;
+  }
+  *rec = src->records[src->next++];
+  return true;
+}
+
+/* 
+ * Description: 
+ * 	Opens a trace stream as a source. The length of the trace is not known, so
+ *      the source reports 0 instructions.
+ * Inputs:
+ * 	src: the source (to be released with tomasulo_stream_source_close)
+ * 	name: the stream (see TRACE STREAMS)
+ * Returns:
+ * 	The source
+ */
+static tom_source_t* tomasulo_stream_source(tom_stream_source_t* src, const char* name) {
+  char header[TRACE_HEADER_SIZE];
+  const tom_file_header_t* h = (const tom_file_header_t*)header;
+  const char* err;
+
+  memset(src, 0, sizeof(*src));
+  src->base.read = stream_source_read;
+  src->base.num_insn = 0;
+  src->fd = stream_open(name, FALSE);
+
+  if (fread(header, sizeof(header), 1, src->fd) != 1)
+    fatal("trace stream `%s' ended before its header", name);
+  if ((err = trace_header_check(header, STREAM_TRACE_MAGIC)))
+    fatal("trace stream `%s' %s", name, err);
+
+  src->block_insns = h->block_insns;
+  src->records = calloc(src->block_insns, sizeof(tom_record_t));
+  src->pc = calloc(src->block_insns, sizeof(md_addr_t));
+  src->buf = malloc(BLOCK_BOUND(src->block_insns));
+  src->dict = calloc(src->block_insns, sizeof(qword_t));
+  if (!src->records || !src->pc || !src->buf || !src->dict)
+    fatal("out of virtual memory");
+  return &src->base;
+}
+
+static void tomasulo_stream_source_close(tom_stream_source_t* src) {
+  if (src->fd != stdin)
+    fclose(src->fd);
+  free(src->records);
+  free(src->pc);
+  free(src->buf);
+  free(src->dict);
+}
+
+/* VARIABLES */
+
+//stack of free reservation stations or functional units
+typedef struct {
+  int* slots;
+  int count;
+} tom_free_list_t;
+
+//wakeup kernel: compares a broadcast tag against lanes source tags (see WAKEUP)
+typedef void (*tom_wakeup_t)(tom_tag_t* src, int lanes, const tom_tag_t* tags, int count, qword_t* matches);
+
+//an instruction between fetch and retirement
+typedef struct {
+  tom_record_t rec;
+  //trace index of the instruction (0 for an entry never used)
+  counter_t index;
+  //its tag once dispatched, FETCHED_TAG before, NO_TAG once it has retired
+  tom_tag_t tag;
+} tom_window_entry_t;
+
+//Reservation station state, one array per field, indexed by station (INT first, then FP).
+//Scans over the stations read only the field they need.
+typedef struct {
+  //tag of the instruction held, NO_TAG if the station is empty
+  tom_tag_t* tag;
+  //class of the instruction held
+  unsigned char* op_class;
+  //trace index of the instruction held
+  counter_t* index;
+  //functional unit executing the instruction held (valid once it has been issued)
+  int* fu;
+  //tag of the producer each source operand waits for, NO_TAG once it is available
+  //(padded to STATION_LANES entries so the wakeup kernels need no tail loop)
+  tom_tag_t* src_tag[3];
+  //number of source operands still waited for
+  int* pending_count;
+} tom_stations_t;
+
+//The state of one simulation. Every pipeline function works on a context, so independent
+//simulations can run side by side (for instance on several threads over the same trace,
+//which is never written).
+struct tomasulo_ctx {
+  //the machine being simulated
+  tom_config_t cfg;
+  //jump over cycles in which nothing can change
+  bool skip_idle_cycles;
+  //keep the timing of every instruction in timing[]
+  bool record_timing;
+  //timing of each instruction, indexed by trace index (record_timing only)
+  tom_timing_t* timing;
+  //number of entries allocated in timing[]
+  counter_t timing_size;
+  //where the instructions come from, and whether it is exhausted
+  tom_source_t* source;
+  bool source_done;
+  //number of instructions in the trace (0 if it is not known in advance)
+  counter_t num_insn;
+
+  counter_t doneCount;
+
+  //instruction queue for tomasulo (trace indices)
+  counter_t* instr_queue;
+  //number of instructions in the instruction queue
+  int instr_queue_size;
+  int ifq_head;
+  int ifq_tail;
+
+  //reservation stations
+  tom_stations_t rs;
+  //reservation stations not holding an instruction, per class
+  tom_free_list_t free_rs_int;
+  tom_free_list_t free_rs_fp;
+
+  //functional units not executing an instruction, per class
+  tom_free_list_t free_fu_int;
+  tom_free_list_t free_fu_fp;
+
+  //common data buses: tags of the instructions broadcasting this cycle
+  tom_tag_t* cdb_tags;
+  int cdb_count;
+
+  //tags not held by any instruction
+  tom_tag_t* free_tags;
+  int free_tag_count;
+  //trace index of the instruction holding each tag
+  counter_t* tag_index;
+
+  //instruction window (see WINDOW): a ring of window_mask + 1 entries
+  tom_window_entry_t* window;
+  counter_t window_mask;
+
+  //the index of the last instruction fetched
+  counter_t fetch_index;
+
+  //number of source operands waiting for the instruction holding each tag
+  int* consumer_count;
+  //compares a broadcast tag against the source tags (chosen for the host CPU)
+  tom_wakeup_t wakeup_kernel;
+  const char* wakeup_name;
+  //scratch set of the operands matched by a broadcast
+  qword_t* matches;
+
+  //stations that are ready to execute (all operands available, not yet executing). It only
+  //changes on dispatch, wakeup and issue, so select only has to look at set bits.
+  qword_t* ready;
+  //stations holding an instruction
+  qword_t* occupied;
+  //stations of each class
+  qword_t* stationsINT;
+  qword_t* stationsFP;
+  //scratch set used by select
+  qword_t* candidates;
+  //age matrix, one row of STATION_WORDS words per station
+  qword_t* age_matrix;
+
+  //completion wheel: first station of each bucket
+  int* wheel_head;
+  //next station in the bucket a station belongs to
+  int* wheel_next;
+  //number of stations in the wheel
+  int wheel_count;
+  //last cycle whose bucket was emptied
+  counter_t wheel_cycle;
+  //stations whose instruction has finished executing and waits for the bus
+  qword_t* finished;
+};
+
+/* FUNCTIONAL UNITS */
+
+/* RESERVATION STATIONS */
+
+//Free stations and functional units are kept on stacks, and every instruction remembers
+//the functional unit it was given, so both allocation and release take constant time.
+//Which station or unit an instruction gets does not affect timing: select and the bus
+//go by age, and all units of a class have the same latency.
+
+TOM_INLINE int free_list_pop(tom_free_list_t* list) {
+  return list->slots[--list->count];
+}
+
+TOM_INLINE void free_list_push(tom_free_list_t* list, int slot) {
+  list->slots[list->count++] = slot;
+}
+
+/* 
+ * Description: 
+ * 	Fills a free list with every slot, the lowest one on top
+ * Inputs:
+ * 	list: the free list
+ * 	first: first slot number
+ * 	size: number of slots
+ * Returns:
+ * 	None
+ */
+static void free_list_fill(tom_free_list_t* list, int first, int size) {
+  list->count = 0;
+  for (int i = size - 1; i >= 0; i--) {
+    free_list_push(list, first + i);
+  }
+}
+
+/* 
+ * Description: 
+ * 	Allocates the slots of a free list
+ * Inputs:
+ * 	list: the free list
+ * 	size: number of slots
+ * Returns:
+ * 	None
+ */
+static void free_list_alloc(tom_free_list_t* list, int size) {
+  list->slots = calloc(size, sizeof(int));
+  if (!list->slots)
+    fatal("out of virtual memory");
+  list->count = 0;
+}
+
+/* WINDOW */
+
+//Fetched instructions live in a ring indexed by trace index until they retire, so memory
+//follows the number of instructions in flight rather than the length of the trace. An
+//entry is reused once its instruction has retired; if the next instruction would land on
+//an instruction still in flight, the ring doubles. A producer that is no longer in its
+//entry has therefore retired.
+#define WINDOW_MIN_SIZE    256
+
+TOM_INLINE tom_window_entry_t* window_entry(tomasulo_ctx_t* ctx, counter_t index) {
+  return &ctx->window[index & ctx->window_mask];
+}
+
+/* 
+ * Description: 
+ * 	Allocates an empty window
+ * Inputs:
+ * 	size: number of entries (a power of two)
+ * Returns:
+ * 	The entries
+ */
+static tom_window_entry_t* window_alloc(counter_t size) {
+  tom_window_entry_t* window = calloc(size, sizeof(tom_window_entry_t));
+  if (!window)
+    fatal("out of virtual memory");
+  for (counter_t i = 0; i < size; i++) {
+    window[i].tag = NO_TAG;
+  }
+  return window;
+}
+
+/* 
+ * Description: 
+ * 	Doubles the window, keeping the instructions in flight
+ * Inputs:
+ * 	ctx: the simulation context
+ * Returns:
+ * 	None
+ */
+static void window_grow(tomasulo_ctx_t* ctx) {
+  const counter_t size = ctx->window_mask + 1;
+  tom_window_entry_t* window = window_alloc(2 * size);
+
+  //in-flight entries keep distinct positions: equal modulo 2 * size implies equal modulo size
+  for (counter_t i = 0; i < size; i++) {
+    if (ctx->window[i].tag != NO_TAG) {
+      window[ctx->window[i].index & (2 * size - 1)] = ctx->window[i];
+    }
+  }
+  free(ctx->window);
+  ctx->window = window;
+  ctx->window_mask = 2 * size - 1;
+}
+
+/* TAGS */
+
+/* 
+ * Description: 
+ * 	Gives a tag to an instruction entering a reservation station
+ * Inputs:
+ * 	ctx: the simulation context
+ * 	index: trace index of the instruction
+ * Returns:
+ * 	The tag
+ */
+TOM_INLINE tom_tag_t alloc_tag(tomasulo_ctx_t* ctx, counter_t index) {
+  assert(ctx->free_tag_count > 0);
+  tom_tag_t tag = ctx->free_tags[--ctx->free_tag_count];
+  ctx->tag_index[tag] = index;
+  window_entry(ctx, index)->tag = tag;
+  return tag;
+}
+
+/* 
+ * Description: 
+ * 	Takes back the tag of an instruction that has retired
+ * Inputs:
+ * 	ctx: the simulation context
+ * 	tag: the tag
+ * Returns:
+ * 	None
+ */
+TOM_INLINE void release_tag(tomasulo_ctx_t* ctx, tom_tag_t tag) {
+  window_entry(ctx, ctx->tag_index[tag])->tag = NO_TAG;
+  ctx->free_tags[ctx->free_tag_count++] = tag;
+}
+
+/* STATION MASKS */
+
+//Sets of reservation stations are kept as bitmasks, one bit per station (INT first, then FP)
+#define MASK_BITS          64
+#define MASK_WORDS(n)      (((n) + MASK_BITS - 1) / MASK_BITS)
+#define STATION_WORDS(cfg) MASK_WORDS(RESERV_TOTAL(cfg))
+
+//Age matrix: row s (the STATION_WORDS words at age_matrix + s * STATION_WORDS) has a bit
+//set for every station holding an instruction older than the one in station s.
+//Instructions are dispatched in program order, so a new row is just the set of occupied
+//stations; the new station's column is cleared in every other row.
+//The oldest member of a set is then the station whose row does not intersect the set.
+
+TOM_INLINE void mask_set(qword_t* mask, int bit) {
+  mask[bit / MASK_BITS] |= (qword_t)1 << (bit % MASK_BITS);
+}
+
+TOM_INLINE void mask_clear(qword_t* mask, int bit) {
+  mask[bit / MASK_BITS] &= ~((qword_t)1 << (bit % MASK_BITS));
+}
+
+/* 
+ * Description: 
+ * 	Finds the first set bit of a mask at or after a given position
+ * Inputs:
+ * 	mask: the bitmask
+ * 	words: number of words in the mask
+ * 	from: first bit position to look at
+ * Returns:
+ * 	The position of the bit, or -1 if there is none
+ */
+TOM_INLINE int mask_next(const qword_t* mask, int words, int from) {
+  for (int w = from / MASK_BITS; w < words; w++) {
+    qword_t bits = mask[w];
+    if (w == from / MASK_BITS) {
+      bits &= ~(qword_t)0 << (from % MASK_BITS);
+    }
+    if (bits) {
+#ifdef __GNUC__
+      return w * MASK_BITS + __builtin_ctzll(bits);
+#else
+      int b = 0;
+      while (!(bits & 1)) {
+        bits >>= 1;
+        b++;
+      }
+      return w * MASK_BITS + b;
+#endif
+    }
+  }
+  return -1;
+}
+
+/* 
+ * Description: 
+ * 	Records a newly dispatched instruction in the age matrix
+ * Inputs:
+ * 	ctx: the simulation context
+ * 	cfg: the machine configuration
+ * 	station: reservation station number (INT first, then FP) it was placed in
+ * Returns:
+ * 	None
+ */
+TOM_INLINE void age_insert(tomasulo_ctx_t* ctx, const tom_config_t cfg, int station) {
+  const int words = STATION_WORDS(cfg);
+  for (int w = 0; w < words; w++) {
+    ctx->age_matrix[station * words + w] = ctx->occupied[w];
+  }
+  for (int s = 0; s < RESERV_TOTAL(cfg); s++) {
+    mask_clear(&ctx->age_matrix[s * words], station);
+  }
+  mask_set(ctx->occupied, station);
+}
+
+/* 
+ * Description: 
+ * 	Finds the station holding the oldest instruction (in program order) of a set
+ * Inputs:
+ * 	ctx: the simulation context
+ * 	cfg: the machine configuration
+ * 	set: bitmask of candidate stations
+ * Returns:
+ * 	The station number, or -1 if the set is empty
+ */
+TOM_INLINE int oldest_station(tomasulo_ctx_t* ctx, const tom_config_t cfg, const qword_t* set) {
+  const int words = STATION_WORDS(cfg);
+  for (int s = mask_next(set, words, 0); s != -1; s = mask_next(set, words, s + 1)) {
+    bool has_older = false;
+    for (int w = 0; w < words; w++) {
+      if (ctx->age_matrix[s * words + w] & set[w]) {
+        has_older = true;
+        break;
+      }
+    }
+    if (!has_older) {
+      return s;
+    }
+  }
+  return -1;
+}
+
+/* WAKEUP */
+
+//A broadcast compares its tag against every source tag of an operand at once: src_tag[i]
+//is a dense array of 16-bit tags, so one vector compare covers 8 (SSE2), 16 (AVX2) or
+//32 (AVX-512) stations. Matching entries are set back to NO_TAG; it is all ones, so
+//OR-ing in the compare result clears exactly the matches. The arrays are padded with
+//NO_TAG, which never matches a broadcast tag.
+#define WAKEUP_LANES       32
+#define STATION_LANES(cfg) ((RESERV_TOTAL(cfg) + WAKEUP_LANES - 1) / WAKEUP_LANES * WAKEUP_LANES)
+
+//Each kernel compares the source tags against all the tags broadcast in a cycle together,
+//handles WAKEUP_LANES stations per step and leaves a bitmask of the matching stations in
+//matches (one bit per station, as in the station masks). An operand waits for a single
+//producer, so it matches at most one of the tags.
+
+static void wakeup_scalar(tom_tag_t* src, int lanes, const tom_tag_t* tags, int count, qword_t* matches) {
+  for (int w = 0; w < MASK_WORDS(lanes); w++) {
+    matches[w] = 0;
+  }
+  for (int s = 0; s < lanes; s++) {
+    for (int t = 0; t < count; t++) {
+      if (src[s] == tags[t]) {
+        src[s] = NO_TAG;
+        matches[s / 64] |= (qword_t)1 << (s % 64);
+        break;
+      }
+    }
+  }
+}
+
+#ifdef TOM_X86_SIMD
+__attribute__((target("sse2")))
+static void wakeup_sse2(tom_tag_t* src, int lanes, const tom_tag_t* tags, int count, qword_t* matches) {
+  for (int s = 0; s < lanes; s += WAKEUP_LANES) {
+    qword_t bits = 0;
+    for (int j = 0; j < WAKEUP_LANES; j += 16) {
+      __m128i lo = _mm_loadu_si128((__m128i*)&src[s + j]);
+      __m128i hi = _mm_loadu_si128((__m128i*)&src[s + j + 8]);
+      __m128i eq_lo = _mm_setzero_si128();
+      __m128i eq_hi = _mm_setzero_si128();
+      for (int t = 0; t < count; t++) {
+        const __m128i key = _mm_set1_epi16(tags[t]);
+        eq_lo = _mm_or_si128(eq_lo, _mm_cmpeq_epi16(lo, key));
+        eq_hi = _mm_or_si128(eq_hi, _mm_cmpeq_epi16(hi, key));
+      }
+      unsigned m = _mm_movemask_epi8(_mm_packs_epi16(eq_lo, eq_hi));
+      if (m) {
+        _mm_storeu_si128((__m128i*)&src[s + j], _mm_or_si128(lo, eq_lo));
+        _mm_storeu_si128((__m128i*)&src[s + j + 8], _mm_or_si128(hi, eq_hi));
+        bits |= (qword_t)m << j;
+      }
+    }
+    if (s % 64 == 0)
+      matches[s / 64] = bits;
+    else
+      matches[s / 64] |= bits << 32;
+  }
+}
+
+__attribute__((target("avx2")))
+static void wakeup_avx2(tom_tag_t* src, int lanes, const tom_tag_t* tags, int count, qword_t* matches) {
+  for (int s = 0; s < lanes; s += WAKEUP_LANES) {
+    __m256i lo = _mm256_loadu_si256((__m256i*)&src[s]);
+    __m256i hi = _mm256_loadu_si256((__m256i*)&src[s + 16]);
+    __m256i eq_lo = _mm256_setzero_si256();
+    __m256i eq_hi = _mm256_setzero_si256();
+    for (int t = 0; t < count; t++) {
+      const __m256i key = _mm256_set1_epi16(tags[t]);
+      eq_lo = _mm256_or_si256(eq_lo, _mm256_cmpeq_epi16(lo, key));
+      eq_hi = _mm256_or_si256(eq_hi, _mm256_cmpeq_epi16(hi, key));
+    }
+    //packing works within 128-bit halves; put the stations back in order
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(eq_lo, eq_hi), 0xd8);
+    qword_t bits = (unsigned)_mm256_movemask_epi8(packed);
+    if (bits) {
+      _mm256_storeu_si256((__m256i*)&src[s], _mm256_or_si256(lo, eq_lo));
+      _mm256_storeu_si256((__m256i*)&src[s + 16], _mm256_or_si256(hi, eq_hi));
+    }
+    if (s % 64 == 0)
+      matches[s / 64] = bits;
+    else
+      matches[s / 64] |= bits << 32;
+  }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void wakeup_avx512(tom_tag_t* src, int lanes, const tom_tag_t* tags, int count, qword_t* matches) {
+  const __m512i none = _mm512_set1_epi16((short)NO_TAG);
+  for (int s = 0; s < lanes; s += WAKEUP_LANES) {
+    __m512i v = _mm512_loadu_si512(&src[s]);
+    __mmask32 m = 0;
+    for (int t = 0; t < count; t++) {
+      m |= _mm512_cmpeq_epi16_mask(v, _mm512_set1_epi16(tags[t]));
+    }
+    if (m) {
+      _mm512_mask_storeu_epi16(&src[s], m, none);
+    }
+    if (s % 64 == 0)
+      matches[s / 64] = m;
+    else
+      matches[s / 64] |= (qword_t)m << 32;
+  }
+}
+#endif
+
+/* 
+ * Description: 
+ * 	Picks the widest wakeup kernel the host CPU supports
+ * Inputs:
+ * 	name: set to the name of the kernel
+ * Returns:
+ * 	The kernel
+ */
+static tom_wakeup_t select_wakeup_kernel(const char** name) {
+#ifdef TOM_X86_SIMD
+  __builtin_cpu_init();
+  if (!force_scalar_wakeup) {
+    if (__builtin_cpu_supports("avx512bw")) {
+      *name = "avx512";
+      return wakeup_avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      *name = "avx2";
+      return wakeup_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+      *name = "sse2";
+      return wakeup_sse2;
+    }
+  }
+#endif
+  *name = "scalar";
+  return wakeup_scalar;
+}
+
+/* COMPLETION WHEEL */
+
+//Instructions in the functional units are kept in a timing wheel: one bucket per cycle,
+//holding the stations whose instruction finishes executing in that cycle. execute_To_CDB
+//empties the current bucket instead of polling every functional unit.
+#define NO_STATION         -1
+
+/* 
+ * Description: 
+ * 	Schedules the completion of an instruction that starts executing
+ * Inputs:
+ * 	ctx: the simulation context
+ * 	cfg: the machine configuration
+ * 	station: reservation station of the instruction
+ * 	done_cycle: the cycle in which it finishes executing
+ * Returns:
+ * 	None
+ */
+TOM_INLINE void wheel_insert(tomasulo_ctx_t* ctx, const tom_config_t cfg, int station, counter_t done_cycle) {
+  int bucket = (int)((qword_t)done_cycle % WHEEL_SIZE(cfg));
+  ctx->wheel_next[station] = ctx->wheel_head[bucket];
+  ctx->wheel_head[bucket] = station;
+  ctx->wheel_count++;
+}
+
+
+/* 
+ * Description: 
+ * 	Checks if simulation is done by finishing the very last instruction
+ *      Remember that simulation is done only if the entire pipeline is empty:
+ *      the source is exhausted and every instruction fetched is done
+ * Inputs:
+ * 	ctx: the simulation context
+ * Returns:
+ * 	True: if simulation is finished
+ */
+static bool is_simulation_done(tomasulo_ctx_t* ctx) {
+
+  return ctx->source_done && ctx->doneCount == ctx->fetch_index;
+}
+
+/* 
+ * Description: 
+ * 	Retires the instructions from writing to the Common Data Buses, waking up all
+ *      their consumers in one pass
+ * Inputs:
+ * 	ctx: the simulation context
+ * 	cfg: the machine configuration
+ * 	current_cycle: the cycle we are at
+ * Returns:
+ * 	None
+ */
+TOM_INLINE void CDB_To_retire(tomasulo_ctx_t* ctx, const tom_config_t cfg, counter_t current_cycle) {
+
+  if (ctx->cdb_count > 0) {
+    bool waited = false;
+    for (int b = 0; b < ctx->cdb_count; b++) {
+      waited = waited || ctx->consumer_count[ctx->cdb_tags[b]] > 0;
+    }
+    if (waited) {
+      const int words = STATION_WORDS(cfg);
+      for (int i = 0; i < 3; i++) {
+        ctx->wakeup_kernel(ctx->rs.src_tag[i], STATION_LANES(cfg), ctx->cdb_tags, ctx->cdb_count, ctx->matches);
+        for (int s = mask_next(ctx->matches, words, 0); s != -1; s = mask_next(ctx->matches, words, s + 1)) {
+          if (--ctx->rs.pending_count[s] == 0) {
+            mask_set(ctx->ready, s);
+          }
+        }
+      }
+    }
+    for (int b = 0; b < ctx->cdb_count; b++) {
+      release_tag(ctx, ctx->cdb_tags[b]);
+    }
+    ctx->doneCount += ctx->cdb_count;
+    ctx->cdb_count = 0;
+  }
+}
+
+/* 
+ * Description: 
+ * 	Releases the functional unit and the reservation station held by an instruction
+ * Inputs:
+ * 	ctx: the simulation context
+ * 	cfg: the machine configuration
+ * 	station: the reservation station (INT first, then FP) of the instruction leaving execute
+ * Returns:
+ * 	The tag of the instruction
+ */
+TOM_INLINE tom_tag_t free_stations(tomasulo_ctx_t* ctx, const tom_config_t cfg, int station) {
+  tom_tag_t tag = ctx->rs.tag[station];
+
+  if (station < cfg.rs_int_size) {
+    free_list_push(&ctx->free_fu_int, ctx->rs.fu[station]);
+    free_list_push(&ctx->free_rs_int, station);
+  } else {
+    free_list_push(&ctx->free_fu_fp, ctx->rs.fu[station]);
+    free_list_push(&ctx->free_rs_fp, station);
+  }
+  ctx->rs.tag[station] = NO_TAG;
+  mask_clear(ctx->occupied, station);
+  return tag;
+}
+
+
+/* 
+ * Description: 
+ * 	Moves the oldest finished instructions from the execution stage to the common data
+ *      buses (one per bus, if possible)
+ * Inputs:
+ * 	ctx: the simulation context
+ * 	cfg: the machine configuration
+ * 	current_cycle: the cycle we are at
+ * Returns:
+ * 	None
+ */
+TOM_INLINE void execute_To_CDB(tomasulo_ctx_t* ctx, const tom_config_t cfg, counter_t current_cycle) {
+
+  //empty the buckets of every cycle up to this one
+  while (ctx->wheel_cycle < current_cycle && ctx->wheel_count > 0) {
+    ctx->wheel_cycle++;
+    int bucket = (int)((qword_t)ctx->wheel_cycle % WHEEL_SIZE(cfg));
+    int next;
+    for (int station = ctx->wheel_head[bucket]; station != NO_STATION; station = next) {
+      next = ctx->wheel_next[station];
+      ctx->wheel_count--;
+      if (ctx->rs.op_class[station] == OPC_STORE) {
+        //stores do not write the bus
+        release_tag(ctx, free_stations(ctx, cfg, station));
+        ctx->doneCount++;
+      }
+      else {
+        mask_set(ctx->finished, station);
+      }
+    }
+    ctx->wheel_head[bucket] = NO_STATION;
+  }
+  ctx->wheel_cycle = current_cycle;
+
+  while (ctx->cdb_count < cfg.cdb_width) {
+    int oldest = oldest_station(ctx, cfg, ctx->finished);
+    if (oldest == -1) {
+      break;
+    }
+    mask_clear(ctx->finished, oldest);
+    if (ctx->record_timing) {
+      ctx->timing[ctx->rs.index[oldest]].cdb = (unsigned int)current_cycle;
+    }
+    //the tag stays with the instruction on the bus
+    ctx->cdb_tags[ctx->cdb_count++] = free_stations(ctx, cfg, oldest);
+  }
+
+}
+
+/* 
+ * Description: 
+ * 	Moves instruction(s) from the issue to the execute stage (if possible). We prioritize old instructions
+ *      (in program order) over new ones, if they both contend for the same functional unit.
+ *      All RAW dependences need to have been resolved with stalls before an instruction enters execute.
+ * Inputs:
+ * 	ctx: the simulation context
+ * 	cfg: the machine configuration
+ * 	current_cycle: the cycle we are at
+ * Returns:
+ * 	None
+ */
+TOM_INLINE void issue_To_execute(tomasulo_ctx_t* ctx, const tom_config_t cfg, counter_t current_cycle) {
+
+  /* ECE552: YOUR CODE GOES HERE */
+  const int words = STATION_WORDS(cfg);
+
+  //ready int instructions
+  for (int w = 0; w < words; w++) {
+    ctx->candidates[w] = ctx->ready[w] & ctx->stationsINT[w];
+  }
+	while (ctx->free_fu_int.count > 0) {
+		//function unit is available, give it to the oldest ready instruction
+		int oldest_rs_int = oldest_station(ctx, cfg, ctx->candidates);
+		if (oldest_rs_int == -1) {
+			break;
+		}
+		mask_clear(ctx->candidates, oldest_rs_int);
+		mask_clear(ctx->ready, oldest_rs_int);
+		if (ctx->record_timing) {
+			ctx->timing[ctx->rs.index[oldest_rs_int]].execute = (unsigned int)current_cycle;
+		}
+		ctx->rs.fu[oldest_rs_int] = free_list_pop(&ctx->free_fu_int);
+		wheel_insert(ctx, cfg, oldest_rs_int, current_cycle + cfg.fu_int_latency);
+	}
+
+  //ready fp instructions
+  for (int w = 0; w < words; w++) {
+    ctx->candidates[w] = ctx->ready[w] & ctx->stationsFP[w];
+  }
+	while (ctx->free_fu_fp.count > 0) {
+		//function unit is available, give it to the oldest ready instruction
+		int oldest_rs_fp = oldest_station(ctx, cfg, ctx->candidates);
+		if (oldest_rs_fp == -1) {
+			break;
+		}
+		mask_clear(ctx->candidates, oldest_rs_fp);
+		mask_clear(ctx->ready, oldest_rs_fp);
+		if (ctx->record_timing) {
+			ctx->timing[ctx->rs.index[oldest_rs_fp]].execute = (unsigned int)current_cycle;
+		}
+		ctx->rs.fu[oldest_rs_fp] = free_list_pop(&ctx->free_fu_fp);
+		wheel_insert(ctx, cfg, oldest_rs_fp, current_cycle + cfg.fu_fp_latency);
+	}
+}
+
+/* 
+ * Description: 
+ * 	Tags a newly dispatched instruction, resolves its operands and registers each
+ *      operand whose producer has not retired on the consumer list of the producer
+ * Inputs:
+ * 	ctx: the simulation context
+ * 	index: trace index of the instruction entering issue
+ * 	instr: the instruction
+ * 	station: reservation station number (INT first, then FP) it was placed in
+ * Returns:
+ * 	None
+ */
+TOM_INLINE void map_operands(tomasulo_ctx_t* ctx, counter_t index, const tom_record_t* instr, int station) {
+  int pending = 0;
+  for (int i = 0; i < 3; i++) {
+    tom_tag_t producer = NO_TAG;
+    if (instr->producer_dist[i]) {
+      const counter_t producer_index = index - instr->producer_dist[i];
+      const tom_window_entry_t* entry = window_entry(ctx, producer_index);
+      if (entry->index == producer_index) {
+        producer = entry->tag;
+      }
+    }
+    if (producer != NO_TAG) {
+      pending++;
+      ctx->consumer_count[producer]++;
+    }
+    ctx->rs.src_tag[i][station] = producer;
+  }
+  tom_tag_t tag = alloc_tag(ctx, index);
+  ctx->consumer_count[tag] = 0;
+  ctx->rs.tag[station] = tag;
+  ctx->rs.op_class[station] = instr->op_class;
+  ctx->rs.index[station] = index;
+  ctx->rs.pending_count[station] = pending;
+  if (pending == 0) {
+    mask_set(ctx->ready, station);
+  }
+}
+
+/* 
+ * Description: 
+ * 	Moves instruction(s) from the dispatch stage to the issue stage, in order, up to
+ *      the dispatch width. Dispatch stops at the first instruction without a free
+ *      reservation station.
+ * Inputs:
+ * 	ctx: the simulation context
+ * 	cfg: the machine configuration
+ * 	current_cycle: the cycle we are at
+ * Returns:
+ * 	None
+ */
+TOM_INLINE void dispatch_To_issue(tomasulo_ctx_t* ctx, const tom_config_t cfg, counter_t current_cycle) {
+  const int batch = ctx->instr_queue_size < cfg.dispatch_width ? ctx->instr_queue_size : cfg.dispatch_width;
+  int slot = ctx->ifq_head;
+  int n;
+
+  for (n = 0; n < batch; n++) {
+    const counter_t index = ctx->instr_queue[slot];
+    tom_window_entry_t* entry = window_entry(ctx, index);
+    int op_class = entry->rec.op_class;
+    if (op_class == OPC_BRANCH) {
+      entry->tag = NO_TAG;
+      ctx->doneCount++;
+
+    } else if (op_class == OPC_FP || op_class == OPC_INT || op_class == OPC_STORE) {
+      tom_free_list_t* free_rs = op_class == OPC_FP ? &ctx->free_rs_fp : &ctx->free_rs_int;
+      if (free_rs->count == 0) {
+        break;
+      }
+      int station = free_list_pop(free_rs);
+      if (ctx->record_timing) {
+        ctx->timing[index].issue = (unsigned int)current_cycle;
+      }
+      map_operands(ctx, index, &entry->rec, station);
+      age_insert(ctx, cfg, station);
+
+    } else {
+      //unrecognized instruction
+      printf("Unrecognized instruction\n");
+      assert(false);
+    }
+
+    slot = slot + 1 == cfg.ifq_size ? 0 : slot + 1;
+  }
+
+  //the queue indices move once for the whole batch
+  ctx->ifq_head = slot;
+  ctx->instr_queue_size -= n;
+}
+
+/* 
+ * Description: 
+ * 	Grabs an instruction from the trace source into the window
+ * Inputs:
+ * 	ctx: the simulation context
+ * Returns:
+ * 	The trace index of the instruction (traps are skipped), or 0 if the source
+ *      ran out of instructions
+ */
+TOM_INLINE counter_t fetch(tomasulo_ctx_t* ctx) {
+  tom_record_t rec;
+  do {
+    if (!ctx->source->read(ctx->source, &rec)) {
+      ctx->source_done = true;
+      return 0;
+    }
+    ctx->fetch_index++;
+    if (rec.op_class == OPC_TRAP) {
+      ctx->doneCount++;
+    }
+  } while (rec.op_class == OPC_TRAP);
+
+  tom_window_entry_t* entry = window_entry(ctx, ctx->fetch_index);
+  while (entry->tag != NO_TAG) {
+    window_grow(ctx);
+    entry = window_entry(ctx, ctx->fetch_index);
+  }
+  entry->rec = rec;
+  entry->index = ctx->fetch_index;
+  entry->tag = FETCHED_TAG;
+  return ctx->fetch_index;
+}
+
+/* 
+ * Description: 
+ * 	Makes room in timing[] for an instruction beyond the length the trace was
+ *      expected to have (for sources that do not know it)
+ * Inputs:
+ * 	ctx: the simulation context
+ * 	index: trace index of the instruction
+ * Returns:
+ * 	None
+ */
+static void grow_timing(tomasulo_ctx_t* ctx, counter_t index) {
+  counter_t size = ctx->timing_size;
+  while (size <= index) {
+    size *= 2;
+  }
+  ctx->timing = realloc(ctx->timing, size * sizeof(tom_timing_t));
+  if (!ctx->timing)
+    fatal("out of virtual memory");
+  memset(ctx->timing + ctx->timing_size, 0, (size - ctx->timing_size) * sizeof(tom_timing_t));
+  ctx->timing_size = size;
+}
+
+/* 
+ * Description: 
+ * 	Fetches up to the fetch width of instructions into the instruction queue
+ * Inputs:
+ * 	ctx: the simulation context
+ * 	cfg: the machine configuration
+ * 	current_cycle: the cycle we are at
+ * Returns:
+ * 	None
+ */
+TOM_INLINE void fetch_To_dispatch(tomasulo_ctx_t* ctx, const tom_config_t cfg, counter_t current_cycle) {
+  const int room = cfg.ifq_size - ctx->instr_queue_size;
+  const int batch = room < cfg.fetch_width ? room : cfg.fetch_width;
+  int slot = ctx->ifq_tail;
+  int n;
+
+  for (n = 0; n < batch && !ctx->source_done; n++) {
+    counter_t index = fetch(ctx);
+    if (!index) {
+      break;
+    }
+    if (ctx->record_timing) {
+      if (index >= ctx->timing_size) {
+        grow_timing(ctx, index);
+      }
+      ctx->timing[index].dispatch = (unsigned int)current_cycle;
+    }
+    ctx->instr_queue[slot] = index;
+    slot = slot + 1 == cfg.ifq_size ? 0 : slot + 1;
+  }
+
+  //the queue indices move once for the whole batch
+  ctx->ifq_tail = slot;
+  ctx->instr_queue_size += n;
+}
+
+/* 
+ * Description: 
+ * 	Finds the next cycle in which some stage can make progress. In any other cycle
+ *      the pipeline state does not change, so the simulation can jump over it and still
+ *      report exactly the same cycle counts as stepping through every cycle.
+ * Inputs:
+ * 	ctx: the simulation context
+ * 	cfg: the machine configuration
+ * 	current_cycle: the cycle about to be simulated
+ * Returns:
+ * 	current_cycle if something can happen in it, otherwise the cycle in which the
+ *      next functional unit finishes
+ */
+TOM_INLINE counter_t next_event_cycle(tomasulo_ctx_t* ctx, const tom_config_t cfg, counter_t current_cycle) {
+  const int words = STATION_WORDS(cfg);
+
+  //a result waits to be broadcast
+  if (ctx->cdb_count > 0) {
+    return current_cycle;
+  }
+
+  //the instruction queue can be refilled
+  if (ctx->instr_queue_size < cfg.ifq_size && !ctx->source_done) {
+    return current_cycle;
+  }
+
+  //the head of the instruction queue can be dispatched
+  if (ctx->instr_queue_size > 0) {
+    int op_class = window_entry(ctx, ctx->instr_queue[ctx->ifq_head])->rec.op_class;
+    if (op_class == OPC_BRANCH) {
+      return current_cycle;
+    }
+    if ((op_class == OPC_FP ? ctx->free_rs_fp.count : ctx->free_rs_int.count) > 0) {
+      return current_cycle;
+    }
+  }
+
+  //a finished instruction waits for the bus
+  for (int w = 0; w < words; w++) {
+    if (ctx->finished[w]) {
+      return current_cycle;
+    }
+  }
+
+  //a ready instruction can be issued to a free functional unit
+  bool readyINT = false;
+  bool readyFP = false;
+  for (int w = 0; w < words; w++) {
+    readyINT = readyINT || (ctx->ready[w] & ctx->stationsINT[w]);
+    readyFP = readyFP || (ctx->ready[w] & ctx->stationsFP[w]);
+  }
+  if ((readyINT && ctx->free_fu_int.count > 0) || (readyFP && ctx->free_fu_fp.count > 0)) {
+    return current_cycle;
+  }
+
+  //nothing in flight: let the stages run so a stuck pipeline still shows up
+  if (ctx->wheel_count == 0) {
+    return current_cycle;
+  }
+
+  //otherwise only a functional unit finishing can change anything
+  counter_t next_cycle = current_cycle;
+  while (ctx->wheel_head[(qword_t)next_cycle % WHEEL_SIZE(cfg)] == NO_STATION) {
+    next_cycle++;
+  }
+  return next_cycle;
+}
+
+/* 
+ * Description: 
+ * 	Empties every pipeline structure of a context so a new simulation can start
+ * Inputs:
+ * 	ctx: the simulation context
+ * Returns:
+ * 	None
+ */
+static void reset_ctx(tomasulo_ctx_t* ctx) {
+  const tom_config_t* cfg = &ctx->cfg;
+  const int total = RESERV_TOTAL(*cfg);
+  const int words = STATION_WORDS(*cfg);
+  int i;
+
+  for (i = 0; i < cfg->ifq_size; i++) {
+    ctx->instr_queue[i] = 0;
+  }
+  for (i = 0; i < total; i++) {
+    ctx->rs.tag[i] = NO_TAG;
+  }
+  for (int op = 0; op < 3; op++) {
+    for (i = 0; i < STATION_LANES(*cfg); i++) {
+      ctx->rs.src_tag[op][i] = NO_TAG;
+    }
+  }
+  free_list_fill(&ctx->free_rs_int, 0, cfg->rs_int_size);
+  free_list_fill(&ctx->free_rs_fp, cfg->rs_int_size, cfg->rs_fp_size);
+  free_list_fill(&ctx->free_fu_int, 0, cfg->fu_int_size);
+  free_list_fill(&ctx->free_fu_fp, 0, cfg->fu_fp_size);
+
+  ctx->doneCount = 0;
+  ctx->fetch_index = 0;
+  ctx->source_done = false;
+  ctx->instr_queue_size = 0;
+  ctx->ifq_head = 0;
+  ctx->ifq_tail = 0;
+  ctx->cdb_count = 0;
+
+  //initialize tag pool
+  for (i = 0; i < TAG_COUNT(*cfg); i++) {
+    ctx->free_tags[i] = i;
+    ctx->consumer_count[i] = 0;
+  }
+  ctx->free_tag_count = TAG_COUNT(*cfg);
+
+  //empty the window (it keeps the size it has grown to)
+  for (counter_t e = 0; e <= ctx->window_mask; e++) {
+    ctx->window[e].index = 0;
+    ctx->window[e].tag = NO_TAG;
+  }
+
+  //initialize station masks
+  for (i = 0; i < words; i++) {
+    ctx->ready[i] = 0;
+    ctx->occupied[i] = 0;
+    ctx->finished[i] = 0;
+    ctx->stationsINT[i] = 0;
+    ctx->stationsFP[i] = 0;
+  }
+  for (i = 0; i < total; i++) {
+    mask_set(i < cfg->rs_int_size ? ctx->stationsINT : ctx->stationsFP, i);
+  }
+
+  //initialize completion wheel
+  for (i = 0; i < WHEEL_SIZE(*cfg); i++) {
+    ctx->wheel_head[i] = NO_STATION;
+  }
+  ctx->wheel_count = 0;
+  ctx->wheel_cycle = 0;
+
+  //initialize timing results
+  if (ctx->record_timing) {
+    if (ctx->timing_size < ctx->num_insn + 1) {
+      free(ctx->timing);
+      ctx->timing_size = ctx->num_insn + 1;
+      ctx->timing = malloc(ctx->timing_size * sizeof(tom_timing_t));
+      if (!ctx->timing)
+        fatal("out of virtual memory");
+    }
+    memset(ctx->timing, 0, ctx->timing_size * sizeof(tom_timing_t));
+  }
+}
+
+/* 
+ * Description: 
+ * 	Creates a simulation context for a machine configuration
+ * Inputs:
+ * 	cfg: the machine configuration
+ * Returns:
+ * 	The new context. It keeps the timing of every instruction and skips idle
+ *      cycles as selected with -tom:skip_idle.
+ */
+tomasulo_ctx_t* tomasulo_ctx_create(const tom_config_t* cfg) {
+  const int total = RESERV_TOTAL(*cfg);
+  const int words = STATION_WORDS(*cfg);
+  tomasulo_ctx_t* ctx;
+
+  check_config(cfg);
+
+  ctx = calloc(1, sizeof(tomasulo_ctx_t));
+  if (!ctx)
+    fatal("out of virtual memory");
+  ctx->cfg = *cfg;
+  ctx->skip_idle_cycles = skip_idle_cycles;
+  ctx->record_timing = TRUE;
+  ctx->wakeup_kernel = select_wakeup_kernel(&ctx->wakeup_name);
+
+  ctx->instr_queue = calloc(cfg->ifq_size, sizeof(counter_t));
+  ctx->rs.tag = calloc(total, sizeof(tom_tag_t));
+  ctx->rs.op_class = calloc(total, sizeof(unsigned char));
+  ctx->rs.index = calloc(total, sizeof(counter_t));
+  for (int i = 0; i < 3; i++) {
+    ctx->rs.src_tag[i] = calloc(STATION_LANES(*cfg), sizeof(tom_tag_t));
+    if (!ctx->rs.src_tag[i])
+      fatal("out of virtual memory");
+  }
+  ctx->rs.pending_count = calloc(total, sizeof(int));
+  ctx->rs.fu = calloc(total, sizeof(int));
+  free_list_alloc(&ctx->free_rs_int, cfg->rs_int_size);
+  free_list_alloc(&ctx->free_rs_fp, cfg->rs_fp_size);
+  free_list_alloc(&ctx->free_fu_int, cfg->fu_int_size);
+  free_list_alloc(&ctx->free_fu_fp, cfg->fu_fp_size);
+  ctx->free_tags = calloc(TAG_COUNT(*cfg), sizeof(tom_tag_t));
+  ctx->tag_index = calloc(TAG_COUNT(*cfg), sizeof(counter_t));
+  ctx->cdb_tags = calloc(cfg->cdb_width, sizeof(tom_tag_t));
+  ctx->consumer_count = calloc(TAG_COUNT(*cfg), sizeof(int));
+  ctx->matches = calloc(words, sizeof(qword_t));
+  ctx->ready = calloc(words, sizeof(qword_t));
+  ctx->occupied = calloc(words, sizeof(qword_t));
+  ctx->stationsINT = calloc(words, sizeof(qword_t));
+  ctx->stationsFP = calloc(words, sizeof(qword_t));
+  ctx->candidates = calloc(words, sizeof(qword_t));
+  ctx->finished = calloc(words, sizeof(qword_t));
+  ctx->age_matrix = calloc(total * words, sizeof(qword_t));
+  ctx->wheel_head = calloc(WHEEL_SIZE(*cfg), sizeof(int));
+  ctx->wheel_next = calloc(total, sizeof(int));
+
+  //room for a few times the instructions the machine can hold; the window grows if needed
+  counter_t window_size = WINDOW_MIN_SIZE;
+  while (window_size < 4 * (counter_t)(cfg->ifq_size + total + cfg->cdb_width)) {
+    window_size *= 2;
+  }
+  ctx->window = window_alloc(window_size);
+  ctx->window_mask = window_size - 1;
+
+  if (!ctx->instr_queue || !ctx->rs.tag || !ctx->rs.op_class || !ctx->rs.index || !ctx->rs.pending_count
+      || !ctx->rs.fu || !ctx->free_tags || !ctx->tag_index || !ctx->cdb_tags || !ctx->consumer_count
+      || !ctx->matches || !ctx->ready || !ctx->occupied || !ctx->stationsINT || !ctx->stationsFP
+      || !ctx->candidates || !ctx->finished || !ctx->age_matrix || !ctx->wheel_head || !ctx->wheel_next)
+    fatal("out of virtual memory");
+
+  return ctx;
+}
+
+/* 
+ * Description: 
+ * 	Releases a simulation context
+ * Inputs:
+ * 	ctx: the simulation context
+ * Returns:
+ * 	None
+ */
+void tomasulo_ctx_free(tomasulo_ctx_t* ctx) {
+  free(ctx->instr_queue);
+  free(ctx->rs.tag);
+  free(ctx->rs.op_class);
+  free(ctx->rs.index);
+  for (int i = 0; i < 3; i++) {
+    free(ctx->rs.src_tag[i]);
+  }
+  free(ctx->rs.pending_count);
+  free(ctx->rs.fu);
+  free(ctx->free_rs_int.slots);
+  free(ctx->free_rs_fp.slots);
+  free(ctx->free_fu_int.slots);
+  free(ctx->free_fu_fp.slots);
+  free(ctx->free_tags);
+  free(ctx->tag_index);
+  free(ctx->cdb_tags);
+  free(ctx->consumer_count);
+  free(ctx->matches);
+  free(ctx->ready);
+  free(ctx->occupied);
+  free(ctx->stationsINT);
+  free(ctx->stationsFP);
+  free(ctx->candidates);
+  free(ctx->finished);
+  free(ctx->age_matrix);
+  free(ctx->wheel_head);
+  free(ctx->wheel_next);
+  free(ctx->timing);
+  free(ctx->window);
+  free(ctx);
+}
+
+/* 
+ * Description: 
+ * 	The cycle-by-cycle simulation loop; every engine is a copy of it
+ * Inputs:
+ * 	ctx: the simulation context
+ * 	cfg: the machine configuration (ctx->cfg, or the same values as constants)
+ * Returns:
+ * 	The total number of cycles it takes to execute the instructions.
+ */
+TOM_INLINE counter_t run_engine(tomasulo_ctx_t* ctx, const tom_config_t cfg) {
+  counter_t cycle = 1;
+  while (true) {
      /* ECE552: YOUR CODE GOES HERE */
-		CDB_To_retire(cycle);
-		execute_To_CDB(cycle);
-		issue_To_execute(cycle);
-		dispatch_To_issue(cycle);
-		fetch_To_dispatch(trace,cycle);
+		CDB_To_retire(ctx, cfg, cycle);
+		execute_To_CDB(ctx, cfg, cycle);
+		issue_To_execute(ctx, cfg, cycle);
+		dispatch_To_issue(ctx, cfg, cycle);
+		fetch_To_dispatch(ctx, cfg, cycle);
 		cycle++;
-		
-    if (is_simulation_done(sim_num_insn))
+
+    if (is_simulation_done(ctx))
       break;
+
+    if (ctx->skip_idle_cycles) {
+      cycle = next_event_cycle(ctx, cfg, cycle);
+    }
 	}
-  
+
   return cycle;
 }
+
+//one engine per preset, with the preset compiled in
+#define TOM_ENGINE(NAME, IFQ, RS_INT, RS_FP, FU_INT, FU_FP, LAT_INT, LAT_FP, CDB, FETCH, DISPATCH) \
+  static counter_t run_##NAME##_engine(tomasulo_ctx_t* ctx) {                             \
+    static const tom_config_t cfg = { IFQ, RS_INT, RS_FP, FU_INT, FU_FP, LAT_INT, LAT_FP,   \
+                                      CDB, FETCH, DISPATCH };                             \
+    return run_engine(ctx, cfg);                                                          \
+  }
+TOM_ENGINE_PRESETS
+#undef TOM_ENGINE
+
+//engine for any configuration
+static counter_t run_generic_engine(tomasulo_ctx_t* ctx) {
+  return run_engine(ctx, ctx->cfg);
+}
+
+typedef counter_t (*tom_engine_t)(tomasulo_ctx_t* ctx);
+
+static const struct {
+  const char* name;
+  tom_config_t cfg;
+  tom_engine_t run;
+} tom_engines[] = {
+#define TOM_ENGINE(NAME, IFQ, RS_INT, RS_FP, FU_INT, FU_FP, LAT_INT, LAT_FP, CDB, FETCH, DISPATCH) \
+  { #NAME, { IFQ, RS_INT, RS_FP, FU_INT, FU_FP, LAT_INT, LAT_FP, CDB, FETCH, DISPATCH }, \
+    run_##NAME##_engine },
+TOM_ENGINE_PRESETS
+#undef TOM_ENGINE
+};
+
+/* 
+ * Description: 
+ * 	Picks the engine for a configuration
+ * Inputs:
+ * 	cfg: the machine configuration
+ * 	name: set to the name of the engine
+ * Returns:
+ * 	The specialized engine of the matching preset, otherwise the generic engine
+ */
+static tom_engine_t select_engine(const tom_config_t* cfg, const char** name) {
+  if (!force_generic_engine) {
+    for (size_t i = 0; i < sizeof(tom_engines) / sizeof(tom_engines[0]); i++) {
+      if (same_config(cfg, &tom_engines[i].cfg)) {
+        *name = tom_engines[i].name;
+        return tom_engines[i].run;
+      }
+    }
+  }
+  *name = "generic";
+  return run_generic_engine;
+}
+
+/* 
+ * Description: 
+ * 	Runs an engine over the instructions of a source, from a reset context
+ * Inputs:
+ * 	ctx: the simulation context
+ * 	engine: the engine
+ * 	source: the trace source, read from its first instruction
+ * Returns:
+ * 	The total number of cycles it takes to execute the instructions.
+ */
+static counter_t run_source(tomasulo_ctx_t* ctx, tom_engine_t engine, tom_source_t* source) {
+  counter_t cycles;
+
+  ctx->source = source;
+  ctx->num_insn = source->num_insn;
+  reset_ctx(ctx);
+  cycles = engine(ctx);
+  ctx->source = NULL;
+  return cycles;
+}
+
+/* 
+ * Description: 
+ * 	Runs an engine over a trace held in memory or in a compressed file
+ * Inputs:
+ * 	ctx: the simulation context
+ * 	engine: the engine
+ *      trace: the decoded trace
+ * Returns:
+ * 	The total number of cycles it takes to execute the instructions.
+ */
+static counter_t run_trace(tomasulo_ctx_t* ctx, tom_engine_t engine, const tom_trace_t* trace) {
+  counter_t cycles;
+
+  if (trace->blocks && block_threads > 0) {
+    tom_prefetch_source_t source;
+    cycles = run_source(ctx, engine, tomasulo_prefetch_source(&source, trace->blocks, block_threads,
+                                                              read_ahead_blocks));
+    tomasulo_prefetch_source_close(&source);
+  } else if (trace->blocks) {
+    tom_block_source_t source;
+    cycles = run_source(ctx, engine, tomasulo_block_source(&source, trace->blocks));
+    tomasulo_block_source_close(&source);
+  } else {
+    tom_decoded_source_t source;
+    cycles = run_source(ctx, engine, tomasulo_decoded_source(&source, trace));
+  }
+  return cycles;
+}
+
+/* 
+ * Description: 
+ * 	Times repeated runs of the selected engine against the generic engine and
+ *      reports the speedup of the specialized code
+ * Inputs:
+ * 	ctx: the simulation context
+ *      trace: the decoded trace
+ * 	runs: number of runs of each engine
+ * Returns:
+ * 	None
+ */
+static void bench_engines(tomasulo_ctx_t* ctx, const tom_trace_t* trace, int runs) {
+  const char* name;
+  tom_engine_t engine = select_engine(&ctx->cfg, &name);
+  clock_t start, selected_time, generic_time;
+  counter_t selected_cycles = 0, generic_cycles = 0;
+
+  start = clock();
+  for (int i = 0; i < runs; i++) {
+    selected_cycles = run_trace(ctx, engine, trace);
+  }
+  selected_time = clock() - start;
+
+  start = clock();
+  for (int i = 0; i < runs; i++) {
+    generic_cycles = run_trace(ctx, run_generic_engine, trace);
+  }
+  generic_time = clock() - start;
+
+  if (selected_cycles != generic_cycles)
+    fatal("engine %s disagrees with the generic engine", name);
+
+  fprintf(stderr, "tomasulo engine bench: %d runs, %s wakeup, %s %.3fs, generic %.3fs, speedup %.2fx\n",
+          runs, ctx->wakeup_name, name, (double)selected_time / CLOCKS_PER_SEC, (double)generic_time / CLOCKS_PER_SEC,
+          selected_time ? (double)generic_time / selected_time : 0.0);
+}
+
+/* 
+ * Description: 
+ * 	Simulates the instructions of a source on the machine of a context. The context
+ *      is reset first, so it can be reused for several runs; contexts are independent
+ *      of each other.
+ * Inputs:
+ * 	ctx: the simulation context
+ * 	source: the trace source, read from its first instruction
+ * Returns:
+ * 	The total number of cycles it takes to execute the instructions.
+ */
+counter_t runTomasulo_source(tomasulo_ctx_t* ctx, tom_source_t* source) {
+  const char* engine_name;
+  return run_source(ctx, select_engine(&ctx->cfg, &engine_name), source);
+}
+
+/* 
+ * Description: 
+ * 	Simulates a decoded trace on the machine of a context (see runTomasulo_source)
+ * Inputs:
+ * 	ctx: the simulation context
+ *      trace: the decoded trace
+ * Returns:
+ * 	The total number of cycles it takes to execute the instructions.
+ */
+counter_t runTomasulo_ctx(tomasulo_ctx_t* ctx, const tom_trace_t* trace) {
+  const char* engine_name;
+  return run_trace(ctx, select_engine(&ctx->cfg, &engine_name), trace);
+}
+
+/* 
+ * Description: 
+ * 	Selects whether the next runs of a context keep the timing of every instruction.
+ *      A context that does not only reads the trace, so several can share it.
+ * Inputs:
+ * 	ctx: the simulation context
+ * 	record: TRUE to keep the timing (the default), FALSE not to
+ * Returns:
+ * 	None
+ */
+void tomasulo_ctx_record_timing(tomasulo_ctx_t* ctx, int record) {
+  ctx->record_timing = record;
+}
+
+/* 
+ * Description: 
+ * 	Timing of the instructions of the last run of a context
+ * Inputs:
+ * 	ctx: the simulation context
+ * Returns:
+ * 	One entry per trace index, or NULL if the context does not record timing
+ */
+const tom_timing_t* tomasulo_ctx_timing(const tomasulo_ctx_t* ctx) {
+  return ctx->record_timing ? ctx->timing : NULL;
+}
+
+/* 
+ * Description: 
+ * 	Copies the timing of the last run of a context into the tom_*_cycle fields of
+ *      the trace, where the rest of the simulator reports it from
+ * Inputs:
+ * 	ctx: the simulation context (recording timing)
+ *      trace: the trace that was simulated
+ * Returns:
+ * 	None
+ */
+static void store_timing(const tomasulo_ctx_t* ctx, instruction_trace_t* trace) {
+  for (counter_t i = 1; i <= ctx->num_insn; i++) {
+    instruction_t* instr = get_instr(trace, i);
+    const tom_timing_t* timing = &ctx->timing[i];
+    instr->tom_dispatch_cycle = timing->dispatch;
+    instr->tom_issue_cycle = timing->issue;
+    instr->tom_execute_cycle = timing->execute;
+    instr->tom_cdb_cycle = timing->cdb;
+  }
+}
+
+/* PARAMETER SWEEPS */
+
+//work shared by the threads of a sweep
+typedef struct {
+  const tom_trace_t* trace;
+  tom_sweep_result_t* results;
+  int count;
+  //next configuration to simulate
+  int next;
+  pthread_mutex_t lock;
+} tom_sweep_t;
+
+/* 
+ * Description: 
+ * 	Sweep thread: simulates configurations until none is left
+ * Inputs:
+ * 	arg: the sweep
+ * Returns:
+ * 	NULL
+ */
+static void* sweep_worker(void* arg) {
+  tom_sweep_t* sweep = arg;
+
+  while (true) {
+    int i;
+    pthread_mutex_lock(&sweep->lock);
+    i = sweep->next++;
+    pthread_mutex_unlock(&sweep->lock);
+    if (i >= sweep->count)
+      break;
+
+    //each run has its own context and leaves the shared trace untouched
+    tomasulo_ctx_t* ctx = tomasulo_ctx_create(&sweep->results[i].cfg);
+    ctx->record_timing = FALSE;
+    sweep->results[i].cycles = runTomasulo_ctx(ctx, sweep->trace);
+    tomasulo_ctx_free(ctx);
+  }
+  return NULL;
+}
+
+/* 
+ * Description: 
+ * 	Simulates one trace on many machine configurations in parallel. The trace is only
+ *      read, so all threads share it.
+ * Inputs:
+ *      trace: the decoded trace
+ * 	results: one entry per configuration, with cfg filled in; cycles is set on return
+ * 	count: number of configurations
+ * 	threads: number of threads to use (0 for one per online processor)
+ * Returns:
+ * 	None
+ */
+void tomasulo_sweep(const tom_trace_t* trace, tom_sweep_result_t* results, int count, int threads) {
+  tom_sweep_t sweep;
+  pthread_t* pool;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    check_config(&results[i].cfg);
+  }
+
+  if (threads <= 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = online > 0 ? (int)online : 1;
+  }
+  if (threads > count) {
+    threads = count;
+  }
+
+  sweep.trace = trace;
+  sweep.results = results;
+  sweep.count = count;
+  sweep.next = 0;
+  pthread_mutex_init(&sweep.lock, NULL);
+
+  pool = calloc(threads, sizeof(pthread_t));
+  if (!pool)
+    fatal("out of virtual memory");
+  for (i = 0; i < threads; i++) {
+    if (pthread_create(&pool[i], NULL, sweep_worker, &sweep))
+      fatal("cannot create sweep thread");
+  }
+  for (i = 0; i < threads; i++) {
+    pthread_join(pool[i], NULL);
+  }
+
+  free(pool);
+  pthread_mutex_destroy(&sweep.lock);
+}
+
+/* 
+ * Description: 
+ * 	Reads the configurations of a sweep, one per line; empty lines and lines
+ *      starting with # are skipped. Trailing fields may be left out and take the
+ *      default values.
+ * Inputs:
+ * 	fname: the sweep file
+ * 	count: set to the number of configurations read
+ * Returns:
+ * 	The configurations (to be freed by the caller)
+ */
+static tom_sweep_result_t* read_sweep_file(const char* fname, int* count) {
+  FILE* fd = fopen(fname, "r");
+  tom_sweep_result_t* results = NULL;
+  int size = 0;
+  char line[256];
+  int lineno = 0;
+
+  if (!fd)
+    fatal("cannot open sweep file `%s'", fname);
+
+  *count = 0;
+  while (fgets(line, sizeof(line), fd)) {
+    tom_config_t cfg;
+    char* p = line;
+
+    lineno++;
+    while (*p == ' ' || *p == '\t')
+      p++;
+    if (*p == '#' || *p == '\n' || *p == '\0')
+      continue;
+
+    //fields in the order of tom_config_t; the ones left out keep their default
+    int* fields[] = { &cfg.ifq_size, &cfg.rs_int_size, &cfg.rs_fp_size, &cfg.fu_int_size,
+                      &cfg.fu_fp_size, &cfg.fu_int_latency, &cfg.fu_fp_latency, &cfg.cdb_width,
+                      &cfg.fetch_width, &cfg.dispatch_width };
+    const int nfields = sizeof(fields) / sizeof(fields[0]);
+    int n = 0, used;
+    cfg.cdb_width = CDB_WIDTH;
+    cfg.fetch_width = FETCH_WIDTH;
+    cfg.dispatch_width = DISPATCH_WIDTH;
+    while (n < nfields && sscanf(p, "%d%n", fields[n], &used) == 1) {
+      p += used;
+      n++;
+    }
+    while (*p == ' ' || *p == '\t' || *p == '\r')
+      p++;
+    //the fetch and dispatch widths come as a pair
+    if (n < 7 || n == 9 || (*p != '\n' && *p != '\0' && *p != '#'))
+      fatal("%s:%d: expected `ifq rs_int rs_fp fu_int fu_fp lat_int lat_fp [cdb [fetch dispatch]]'",
+            fname, lineno);
+
+    if (*count == size) {
+      size = size ? 2 * size : 64;
+      results = realloc(results, size * sizeof(tom_sweep_result_t));
+      if (!results)
+        fatal("out of virtual memory");
+    }
+    results[*count].cfg = cfg;
+    results[*count].cycles = 0;
+    (*count)++;
+  }
+  fclose(fd);
+
+  if (*count == 0)
+    fatal("sweep file `%s' lists no configuration", fname);
+  return results;
+}
+
+/* 
+ * Description: 
+ * 	Prints the results of a sweep as a table
+ * Inputs:
+ * 	fd: output stream
+ * 	results: the results
+ * 	count: number of results
+ * 	num_insn: the number of instructions in the trace
+ * Returns:
+ * 	None
+ */
+static void print_sweep(FILE* fd, const tom_sweep_result_t* results, int count, counter_t num_insn) {
+  fprintf(fd, "%5s %6s %5s %6s %5s %7s %6s %3s %5s %8s %12s %8s\n",
+          "ifq", "rs_int", "rs_fp", "fu_int", "fu_fp", "lat_int", "lat_fp", "cdb", "fetch", "dispatch",
+          "cycles", "CPI");
+  for (int i = 0; i < count; i++) {
+    const tom_config_t* cfg = &results[i].cfg;
+    fprintf(fd, "%5d %6d %5d %6d %5d %7d %6d %3d %5d %8d %12lld %8.4f\n",
+            cfg->ifq_size, cfg->rs_int_size, cfg->rs_fp_size, cfg->fu_int_size, cfg->fu_fp_size,
+            cfg->fu_int_latency, cfg->fu_fp_latency, cfg->cdb_width, cfg->fetch_width,
+            cfg->dispatch_width, (long long)results[i].cycles,
+            num_insn ? (double)results[i].cycles / num_insn : 0.0);
+  }
+}
+
+/* 
+ * Description: 
+ * 	Runs the sweep selected with -tom:sweep over a trace and reports the results
+ * Inputs:
+ *      trace: the decoded trace
+ * Returns:
+ * 	None
+ */
+static void run_sweep_file(const tom_trace_t* trace) {
+  int count;
+  tom_sweep_result_t* results = read_sweep_file(sweep_file, &count);
+  FILE* fd = stderr;
+
+  tomasulo_sweep(trace, results, count, sweep_threads);
+
+  if (sweep_out_file) {
+    fd = fopen(sweep_out_file, "w");
+    if (!fd)
+      fatal("cannot open sweep output file `%s'", sweep_out_file);
+  }
+  print_sweep(fd, results, count, trace->num_insn);
+  if (fd != stderr) {
+    fclose(fd);
+  }
+  free(results);
+}
+
+/* TRACE CACHE */
+
+//Traces are kept in the cache directory under a hash of the program binary, its arguments
+//and the instruction limit of the run. The simulator asks for a trace with
+//tomasulo_trace_cache_lookup before loading the program: on a hit it skips the loader and
+//the functional simulation and runTomasulo replays the cached trace, on a miss runTomasulo
+//adds the trace of the run. A trace is written under a temporary name and renamed into
+//place once it is on disk, so processes sharing the cache only ever see complete files; two
+//processes missing on the same key write the same trace, and the last rename wins. Entries
+//are still checked on lookup, and one that is not a complete trace is a miss.
+
+//file a missed trace is added to by runTomasulo (NULL if there is none to add)
+static char* trace_cache_store = NULL;
+//cached trace found by the last lookup, replayed through replay_file (NULL on a miss)
+static char* trace_cache_hit = NULL;
+
+#define FNV_OFFSET         0xcbf29ce484222325ULL
+#define FNV_PRIME          0x100000001b3ULL
+
+TOM_INLINE qword_t fnv_hash(qword_t hash, const void* data, size_t size) {
+  const unsigned char* p = data;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ p[i]) * FNV_PRIME;
+  }
+  return hash;
+}
+
+/* 
+ * Description: 
+ * 	Writes the decoded trace of a run to a trace file, compressed unless
+ *      -tom:trace_block is 0
+ * Inputs:
+ * 	fname: the trace file
+ *      trace: instruction trace with all the instructions executed
+ * 	num_insn: the number of instructions in the trace
+ * Returns:
+ * 	TRUE if the file was written
+ */
+static int write_trace_file(const char* fname, instruction_trace_t* trace, counter_t num_insn) {
+  if (trace_block_insns > 0)
+    return tomasulo_trace_write_blocks(fname, trace, num_insn, trace_block_insns);
+  return tomasulo_trace_write(fname, trace, num_insn);
+}
+
+/* 
+ * Description: 
+ * 	Checks that a cached trace is complete, so that a file torn by a crash (or
+ *      left by another version) is taken for a miss and written again
+ * Inputs:
+ * 	fname: the cached trace
+ * Returns:
+ * 	TRUE if it can be replayed
+ */
+static int trace_cache_valid(const char* fname) {
+  char header[TRACE_HEADER_SIZE];
+  const tom_file_header_t* h = (const tom_file_header_t*)header;
+  struct stat st;
+  qword_t size;
+  int fd = open(fname, O_RDONLY);
+
+  if (fd < 0)
+    return FALSE;
+  if (fstat(fd, &st) != 0 || pread(fd, header, sizeof(header), 0) != sizeof(header)) {
+    close(fd);
+    return FALSE;
+  }
+  close(fd);
+
+  //the key holds the instruction limit, which a program that exits early stops short of
+  if (!trace_header_check(header, TRACE_MAGIC)) {
+    size = TRACE_FILE_SIZE(h->num_insn);
+  } else if (!trace_header_check(header, BLOCK_TRACE_MAGIC)) {
+    const qword_t num_blocks = (h->num_insn + h->block_insns - 1) / h->block_insns;
+    size = h->index_offset + (num_blocks + 1) * sizeof(qword_t);
+  } else {
+    return FALSE;
+  }
+  return (qword_t)st.st_size == size;
+}
+
+/* 
+ * Description: 
+ * 	Looks a run up in the trace cache (-tom:trace_cache). On a hit the cached trace
+ *      is replayed by the next runTomasulo, which may then be passed a NULL trace; on a
+ *      miss the next runTomasulo adds the trace of the run to the cache.
+ * Inputs:
+ * 	binary: the program binary
+ * 	argc: number of arguments of the program (including its name)
+ * 	argv: the arguments
+ * 	num_insn: the most instructions that will be simulated (the run may stop sooner)
+ * Returns:
+ * 	TRUE if the trace is in the cache, so the program need not be simulated
+ */
+int tomasulo_trace_cache_lookup(const char* binary, int argc, char** argv, counter_t num_insn) {
+  unsigned char buf[65536];
+  qword_t hash = FNV_OFFSET;
+  const unsigned int version = TRACE_VERSION;
+  size_t n;
+  FILE* fd;
+  char* path;
+
+  //forget the previous lookup (replay_file otherwise belongs to the options)
+  if (trace_cache_hit && replay_file == trace_cache_hit)
+    replay_file = NULL;
+  free(trace_cache_hit);
+  free(trace_cache_store);
+  trace_cache_hit = NULL;
+  trace_cache_store = NULL;
+  if (!trace_cache_dir)
+    return FALSE;
+
+  fd = fopen(binary, "rb");
+  if (!fd)
+    fatal("cannot open program `%s'", binary);
+  while ((n = fread(buf, 1, sizeof(buf), fd)) > 0) {
+    hash = fnv_hash(hash, buf, n);
+  }
+  fclose(fd);
+
+  //arguments are hashed with their lengths, so that splitting them differently changes the key
+  for (int i = 0; i < argc; i++) {
+    const size_t len = strlen(argv[i]);
+    hash = fnv_hash(hash, &len, sizeof(len));
+    hash = fnv_hash(hash, argv[i], len);
+  }
+  hash = fnv_hash(hash, &num_insn, sizeof(num_insn));
+  hash = fnv_hash(hash, &version, sizeof(version));
+
+  path = malloc(strlen(trace_cache_dir) + 32);
+  if (!path)
+    fatal("out of virtual memory");
+  sprintf(path, "%s/%016llx.trace", trace_cache_dir, (unsigned long long)hash);
+
+  if (trace_cache_valid(path)) {
+    trace_cache_hit = path;
+    replay_file = path;
+    return TRUE;
+  }
+  trace_cache_store = path;
+  return FALSE;
+}
+
+/* 
+ * Description: 
+ * 	Adds the trace of a run to the cache, under the name given by the last lookup
+ * Inputs:
+ *      trace: instruction trace with all the instructions executed
+ * 	num_insn: the number of instructions in the trace
+ * Returns:
+ * 	None
+ */
+static void trace_cache_add(instruction_trace_t* trace, counter_t num_insn) {
+  char* tmp = malloc(strlen(trace_cache_store) + 8);
+  int fd;
+
+  if (!tmp)
+    fatal("out of virtual memory");
+  sprintf(tmp, "%s.XXXXXX", trace_cache_store);
+  fd = mkstemp(tmp);
+  if (fd < 0) {
+    //the run does not depend on the cache, so an unwritable cache is not an error
+    warn("cannot add to trace cache `%s'", trace_cache_dir);
+    free(tmp);
+    return;
+  }
+  //other processes of the cache are to read it (mkstemp creates it private)
+  fchmod(fd, 0644);
+
+  //the file is written through its name; fd still syncs it before it is renamed into place
+  if (!write_trace_file(tmp, trace, num_insn) || fsync(fd) != 0
+      || rename(tmp, trace_cache_store) != 0) {
+    warn("cannot add to trace cache `%s'", trace_cache_dir);
+    unlink(tmp);
+  }
+  close(fd);
+  free(tmp);
+  free(trace_cache_store);
+  trace_cache_store = NULL;
+}
+
+/* 
+ * Description: 
+ * 	Performs a cycle-by-cycle simulation of the 4-stage pipeline
+ * Inputs:
+ *      trace: instruction trace with all the instructions executed
+ * Returns:
+ * 	The total number of cycles it takes to execute the instructions.
+ * Extra Notes:
+ * 	sim_num_insn: the number of instructions in the trace
+ *      the machine is the one selected with the -tom: options; a specialized
+ *      engine is used when they match one of the presets. With -tom:sweep the
+ *      listed configurations are simulated on the same trace first.
+ *      The simulated run decodes the trace as it goes (on its own thread with
+ *      -tom:decode_thread); the whole trace is only decoded up front when a sweep
+ *      or bench needs to replay it. The trace is only written once the run is
+ *      over, to report the timing of every instruction.
+ *      With -tom:replay, or after a hit in the trace cache, the trace file is
+ *      simulated instead and trace is not used (sim_num_insn is set to the length
+ *      of the file). The same goes for -tom:stream_in, where the run lasts until
+ *      the stream is closed and the pipeline has drained.
+ */
+counter_t runTomasulo(instruction_trace_t* trace)
+{
+  tomasulo_ctx_t* ctx = tomasulo_ctx_create(&tom_config);
+  tom_trace_source_t source;
+  tom_trace_t* decoded = NULL;
+  counter_t cycles;
+
+  //checked before anything is simulated, not when the trace is written
+  if (trace_block_insns < 0 || trace_block_insns > MAX_BLOCK_INSNS)
+    fatal("-tom:trace_block must be between 0 and %d", MAX_BLOCK_INSNS);
+  //the simulated program has already written its own output to stdout
+  if (stream_out_name && strcmp(stream_out_name, "-") == 0)
+    fatal("-tom:stream_out cannot be stdout, which the simulated program writes to");
+
+  if (stream_in_name) {
+    tom_stream_source_t stream;
+    //a stream is read once, as it arrives
+    if (replay_file || engine_bench_runs > 0 || sweep_file)
+      fatal("-tom:stream_in cannot be combined with -tom:replay, -tom:bench or -tom:sweep");
+    ctx->record_timing = FALSE;
+    cycles = runTomasulo_source(ctx, tomasulo_stream_source(&stream, stream_in_name));
+    sim_num_insn = ctx->fetch_index;
+    tomasulo_stream_source_close(&stream);
+    tomasulo_ctx_free(ctx);
+    return cycles;
+  }
+
+  if (replay_file) {
+    decoded = tomasulo_trace_open(replay_file);
+    sim_num_insn = decoded->num_insn;
+    //there are no instructions to report the timing of
+    ctx->record_timing = FALSE;
+  } else {
+    if (trace_out_file && !write_trace_file(trace_out_file, trace, sim_num_insn)) {
+      fatal("cannot write trace file `%s'", trace_out_file);
+    }
+    if (trace_cache_store) {
+      trace_cache_add(trace, sim_num_insn);
+    }
+    if (stream_out_name) {
+      tom_stream_writer_t* w = tomasulo_stream_writer_open(stream_out_name, trace_block_insns > 0
+                                                           ? trace_block_insns : TRACE_BLOCK_INSNS);
+      for (counter_t i = 1; i <= sim_num_insn; i++) {
+        tomasulo_stream_put(w, get_instr(trace, i));
+      }
+      tomasulo_stream_writer_close(w);
+    }
+    if (engine_bench_runs > 0 || sweep_file) {
+      decoded = tomasulo_decode(trace, sim_num_insn);
+    }
+  }
+
+  if (engine_bench_runs > 0) {
+    bench_engines(ctx, decoded, engine_bench_runs);
+  }
+  if (sweep_file) {
+    run_sweep_file(decoded);
+  }
+
+  if (replay_file) {
+    cycles = runTomasulo_ctx(ctx, decoded);
+  } else if (decode_thread) {
+    tom_producer_t producer = { tomasulo_ring_create(sim_num_insn), trace, sim_num_insn };
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, trace_producer, &producer))
+      fatal("cannot create decode thread");
+    cycles = runTomasulo_source(ctx, tomasulo_ring_source(producer.ring));
+    pthread_join(thread, NULL);
+    tomasulo_ring_free(producer.ring);
+  } else {
+    cycles = runTomasulo_source(ctx, tomasulo_trace_source(&source, trace, sim_num_insn));
+  }
+  if (ctx->record_timing) {
+    store_timing(ctx, trace);
+  }
+  tomasulo_ctx_free(ctx);
+  if (decoded) {
+    tomasulo_trace_free(decoded);
+  }
+  return cycles;
+}
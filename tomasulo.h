@@ -0,0 +1,90 @@
+/*
+ * Interface of the Tomasulo timing model (tomasulo.c) to the rest of the simulator.
+ * Include it after host.h, options.h and instr.h.
+ */
+#ifndef TOMASULO_H
+#define TOMASULO_H
+
+/* MACHINE CONFIGURATION */
+
+//sizes and latencies of the simulated machine
+typedef struct {
+  int ifq_size;
+  int rs_int_size;
+  int rs_fp_size;
+  int fu_int_size;
+  int fu_fp_size;
+  int fu_int_latency;
+  int fu_fp_latency;
+  int cdb_width;
+  int fetch_width;
+  int dispatch_width;
+} tom_config_t;
+
+//registers the -tom: options (called from sim_reg_options)
+void tomasulo_reg_options(struct opt_odb_t *odb);
+
+//simulates a trace on the machine selected with the -tom: options
+counter_t runTomasulo(instruction_trace_t* trace);
+
+/* TRACES AND SOURCES */
+
+//a decoded trace, read only while it is simulated
+typedef struct tom_trace tom_trace_t;
+//a trace delivered one instruction at a time
+typedef struct tom_source tom_source_t;
+//a source fed by another thread
+typedef struct tom_ring_source tom_ring_source_t;
+//the producer side of a trace stream
+typedef struct tom_stream_writer tom_stream_writer_t;
+
+tom_trace_t* tomasulo_decode(instruction_trace_t* trace, counter_t num_insn);
+tom_trace_t* tomasulo_trace_open(const char* fname);
+void tomasulo_trace_free(tom_trace_t* decoded);
+
+tom_ring_source_t* tomasulo_ring_create(counter_t num_insn);
+tom_source_t* tomasulo_ring_source(tom_ring_source_t* ring);
+void tomasulo_ring_put(tom_ring_source_t* ring, const instruction_t* instr);
+void tomasulo_ring_close(tom_ring_source_t* ring);
+void tomasulo_ring_free(tom_ring_source_t* ring);
+
+tom_stream_writer_t* tomasulo_stream_writer_open(const char* name, int block_insns);
+void tomasulo_stream_put(tom_stream_writer_t* w, const instruction_t* instr);
+void tomasulo_stream_writer_close(tom_stream_writer_t* w);
+
+//looks a run up in the trace cache before the program is loaded
+int tomasulo_trace_cache_lookup(const char* binary, int argc, char** argv, counter_t num_insn);
+
+/* SIMULATION CONTEXTS */
+
+//state of one simulation; contexts are independent, so each thread can run its own
+typedef struct tomasulo_ctx tomasulo_ctx_t;
+
+//cycle in which an instruction entered each stage (0 if it never did). Only the low 32 bits
+//are kept, as many as the int tom_*_cycle fields of the trace report, so that the array
+//kept for every instruction stays at 16 bytes an entry.
+typedef struct {
+  unsigned int dispatch;
+  unsigned int issue;
+  unsigned int execute;
+  unsigned int cdb;
+} tom_timing_t;
+
+tomasulo_ctx_t* tomasulo_ctx_create(const tom_config_t* cfg);
+void tomasulo_ctx_free(tomasulo_ctx_t* ctx);
+void tomasulo_ctx_record_timing(tomasulo_ctx_t* ctx, int record);
+counter_t runTomasulo_ctx(tomasulo_ctx_t* ctx, const tom_trace_t* trace);
+counter_t runTomasulo_source(tomasulo_ctx_t* ctx, tom_source_t* source);
+const tom_timing_t* tomasulo_ctx_timing(const tomasulo_ctx_t* ctx);
+
+/* PARAMETER SWEEPS */
+
+//result of one configuration of a sweep
+typedef struct {
+  tom_config_t cfg;
+  counter_t cycles;
+} tom_sweep_result_t;
+
+void tomasulo_sweep(const tom_trace_t* trace, tom_sweep_result_t* results, int count, int threads);
+
+#endif /* TOMASULO_H */